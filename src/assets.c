@@ -149,148 +149,1110 @@ Sound read_raw_sound(int pool, char * file_name)
 }
 
 //
-// Loading assets.
+// Assets.
+//
+// Every asset is described by a line of the manifest (assets/manifest.txt):
+// its name, the file it is loaded from, what kind of asset it is, which group
+// it belongs to and its geometry. For animations the width and height are of a
+// single frame (zero meaning the width of the image, or its height divided by
+// the frame count). For fonts they are the size of a single character.
+//
+// Assets that are only used by one scene belong to that scene's group, and are
+// only loaded while it is needed (see load_asset_group).
+//
+
+#define ASSET_NAME_MAX 32
+#define MANIFEST_FILE_NAME "manifest.txt"
+
+typedef enum
+{
+    ASSET_IMAGE,
+    ASSET_ANIMATION,
+    ASSET_FONT,
+    ASSET_SOUND,
+    ASSET_KIND_COUNT,
+}
+Asset_Kind;
+
+typedef enum
+{
+    ASSET_GROUP_SHARED,
+    ASSET_GROUP_HEART,
+    ASSET_GROUP_LUNGS,
+    ASSET_GROUP_DIGESTION,
+    ASSET_GROUP_COUNT,
+}
+Asset_Group;
+
+// The names used for kinds and groups in the manifest.
+char * asset_kind_names[ASSET_KIND_COUNT] =
+{
+    [ASSET_IMAGE]     = "image",
+    [ASSET_ANIMATION] = "animation",
+    [ASSET_FONT]      = "font",
+    [ASSET_SOUND]     = "sound",
+};
+
+char * asset_group_names[ASSET_GROUP_COUNT] =
+{
+    [ASSET_GROUP_SHARED]    = "shared",
+    [ASSET_GROUP_HEART]     = "heart",
+    [ASSET_GROUP_LUNGS]     = "lungs",
+    [ASSET_GROUP_DIGESTION] = "digestion",
+};
+
+//
+// Asset archive format.
 //
-// All assets are loaded into a single struct, with references to them taken
-// when needed. load_assets should be called at launch with a suitable path.
+// All of the assets can be packed into a single archive file by the asset
+// cooker (see cooker.c). It starts with a header and a table of contents,
+// followed by the data of each asset. Pixels are stored in runtime order and
+// sounds as f32 samples, and each one is aligned to ASSET_ARCHIVE_ALIGNMENT
+// bytes from the start of the file, so the archive is mapped into memory and
+// the assets point straight into it. Nothing is copied or converted, and the
+// mapped pages can be shared between running instances of the game. The table
+// of contents holds everything from the manifest, so it is not needed when
+// there is an archive.
 //
+// The data of an asset can also be compressed (see compress.c), in which case
+// it is decompressed into a pool when the asset is loaded. Pixels use the LZ
+// codec, and samples are transposed into byte planes before that.
+//
+// An animation that is a mirror image of another one shares its data, and
+// only has its own frame table. It is drawn flipped.
+//
+// Images and animations with few enough colours are stored indexed (see
+// graphics.c). Their data is the palette followed by the indices, and frame
+// table offsets count indices rather than pixels.
+//
+// Indexed animations can also be delta encoded (see graphics.c). After the
+// palette comes the table of Delta_Frames, then the Delta_Spans, the indices of
+// the keyframe, and then the indices of every span. There is no frame table.
+//
+
+#define ASSET_ARCHIVE_MAGIC "RHYTHMAR"
+#define ASSET_ARCHIVE_VERSION 7
+#define ASSET_ARCHIVE_ALIGNMENT 64
+#define ASSET_ARCHIVE_FILE_NAME "assets.pack"
+#define PALETTE_BYTE_COUNT (256 * sizeof(u32))
+// The largest width, height or frame count of an image, animation or font, so
+// that trimmed frames fit in an Animation_Frame.
+#define ASSET_ARCHIVE_MAX_SIZE 32767
+
+typedef struct
+{
+    char magic[8];
+    u32 version;
+    u32 entry_count;
+}
+Asset_Archive_Header;
+
+typedef enum
+{
+    ASSET_ENCODING_RAW,
+    ASSET_ENCODING_LZ,
+    ASSET_ENCODING_TRANSPOSED_LZ,
+}
+Asset_Encoding;
+
+// The width and height have the same meaning as they do for store_asset.
+// Offsets are from the start of the archive. byte_count is the size of the
+// data in the archive, and decoded_byte_count is its size once decompressed.
+// source_entry is one plus the index of the entry whose data is shared, or zero.
+typedef struct
+{
+    char name[ASSET_NAME_MAX];
+    char file_name[ASSET_NAME_MAX];
+    u32 kind;
+    u32 group;
+    s32 width;
+    s32 height;
+    s32 frame_count;
+    s32 frame_duration_ms;
+    u32 encoding;
+    u32 flip;
+    u32 source_entry;
+    u32 indexed;
+    u32 delta;
+    u32 reserved;
+    u64 offset;
+    u64 byte_count;
+    u64 decoded_byte_count;
+    u64 frame_table_offset;     // Zero if the frames are not trimmed.
+}
+Asset_Archive_Entry;
+
+// Round byte_count up to the alignment of data in an archive.
+static inline u64 align_archive_offset(u64 byte_count)
+{
+    return (byte_count + ASSET_ARCHIVE_ALIGNMENT - 1) &
+        ~(u64)(ASSET_ARCHIVE_ALIGNMENT - 1);
+}
+
+//
+// Asset registry.
+//
+// All assets are kept in a single array, and are found by a hash of their name
+// using an open-addressing hash table. Lookups take a name, which is hashed by
+// an inline function (so a literal name is usually hashed at compile time),
+// and return a typed handle, which is just an index into the array. Index zero
+// holds a blank asset, which is what a failed lookup returns.
+//
+
+#define MAX_ASSETS 1024
+#define ASSET_SLOT_COUNT (MAX_ASSETS * 2)
+
+typedef struct
+{
+    char name[ASSET_NAME_MAX];
+    char file_name[ASSET_NAME_MAX];
+    u32 id;
+    Asset_Kind kind;
+    Asset_Group group;
+    int width;
+    int height;
+    int frame_count;
+    int frame_duration_ms;
+    Asset_Archive_Entry * archive_entry;    // NULL if loaded from a file.
+    f32 load_time_ms;
+    union
+    {
+        Image image;
+        Animated_Image animation;
+        Font font;
+        Sound sound;
+    };
+}
+Asset;
 
 struct
 {
-    Animated_Image button_animation;
-    Animated_Image heart_animation;
-    Animated_Image left_lung_animation;
-    Animated_Image right_lung_animation;
-    Animated_Image digestion_animation;
-    Font main_font;
-    Font scream_font;
-    Image heart_icon;
-    Image morse_background;
-    Image relaxed_skeleton;
-    Sound wood_block_sound;
-    Sound yay_sound;
-    Sound shaker_sound;
-    Sound tap_sound;
-    Sound clock_sound;
-    Sound brown_sound;
-}
-assets;
-
-// Load all assets, given a path relative to the location of the executable
-// (or app bundle).
-bool load_assets(char * assets_dir)
+    Asset * assets;
+    int asset_count;
+    u32 * slots;    // Indices into assets, or zero if the slot is empty.
+}
+asset_registry;
+
+typedef struct { u32 index; } Image_Handle;
+typedef struct { u32 index; } Animation_Handle;
+typedef struct { u32 index; } Font_Handle;
+typedef struct { u32 index; } Sound_Handle;
+
+// Hash an asset name into its ID (32-bit FNV-1a).
+static inline u32 asset_id(char * name)
 {
-    char * full_dir = pool_alloc(FRAME_POOL, 512);
-    char * base_path = SDL_GetBasePath();
-    snprintf(full_dir, 512, "%s%s", base_path, assets_dir ? assets_dir : "");
-    SDL_free(base_path);
-    chdir(full_dir);
+    u32 hash = 2166136261u;
+    while (*name) hash = (hash ^ (u8)*name++) * 16777619u;
+    // Zero is used to mark the blank asset.
+    return hash ? hash : 1;
+}
+
+// Allocate an empty registry.
+// Returns false if the memory could not be allocated.
+bool init_asset_registry(int pool_index)
+{
+    asset_registry.assets = pool_alloc(pool_index, MAX_ASSETS * sizeof(Asset));
+    asset_registry.slots = pool_alloc(pool_index, ASSET_SLOT_COUNT * sizeof(u32));
+    if (!asset_registry.assets || !asset_registry.slots) return false;
+    set_memory(asset_registry.slots, ASSET_SLOT_COUNT * sizeof(u32), 0);
+    asset_registry.assets[0] = (Asset){};
+    asset_registry.asset_count = 1;
+    return true;
+}
+
+// Add an asset to the registry.
+// Returns NULL if the registry is full, or an asset with the same ID exists.
+Asset * register_asset(Asset * asset)
+{
+    if (asset_registry.asset_count == MAX_ASSETS) return NULL;
+    u32 id = asset_id(asset->name);
+    u32 slot = id & (ASSET_SLOT_COUNT - 1);
+    while (asset_registry.slots[slot])
+    {
+        if (asset_registry.assets[asset_registry.slots[slot]].id == id) return NULL;
+        slot = (slot + 1) & (ASSET_SLOT_COUNT - 1);
+    }
+    u32 index = asset_registry.asset_count++;
+    asset_registry.slots[slot] = index;
+    Asset * registered = &asset_registry.assets[index];
+    *registered = *asset;
+    registered->id = id;
+    return registered;
+}
+
+// Remove every asset registered since there were asset_count of them. Assets
+// never sit in the way of ones registered before them, so their slots can
+// simply be emptied.
+void unregister_assets_after(int asset_count)
+{
+    for (u32 slot = 0; slot < ASSET_SLOT_COUNT; ++slot)
+    {
+        if (asset_registry.slots[slot] >= (u32)asset_count) asset_registry.slots[slot] = 0;
+    }
+    asset_registry.asset_count = asset_count;
+}
+
+// Returns the index of the asset with the given ID and kind, or zero.
+u32 find_asset(u32 id, Asset_Kind kind)
+{
+    u32 slot = id & (ASSET_SLOT_COUNT - 1);
+    u32 index;
+    while ((index = asset_registry.slots[slot]))
+    {
+        Asset * asset = &asset_registry.assets[index];
+        if (asset->id == id) return asset->kind == kind ? index : 0;
+        slot = (slot + 1) & (ASSET_SLOT_COUNT - 1);
+    }
+    return 0;
+}
+
+// Returns the asset loaded from the given file, or NULL.
+// This searches every asset, so should not be used often.
+Asset * find_asset_by_file_name(char * file_name)
+{
+    for (int i = 1; i < asset_registry.asset_count; ++i)
+    {
+        Asset * asset = &asset_registry.assets[i];
+        if (strcmp(asset->file_name, file_name) == 0) return asset;
+    }
+    return NULL;
+}
+
+static inline Image_Handle find_image(char * name)
+{
+    return (Image_Handle){ find_asset(asset_id(name), ASSET_IMAGE) };
+}
+
+static inline Animation_Handle find_animation(char * name)
+{
+    return (Animation_Handle){ find_asset(asset_id(name), ASSET_ANIMATION) };
+}
+
+static inline Font_Handle find_font(char * name)
+{
+    return (Font_Handle){ find_asset(asset_id(name), ASSET_FONT) };
+}
 
-    assets.relaxed_skeleton = read_image_file(PERSIST_POOL, "relaxed_skeleton.pam");
-    if (!assets.relaxed_skeleton.pixels) return false;
+static inline Sound_Handle find_sound(char * name)
+{
+    return (Sound_Handle){ find_asset(asset_id(name), ASSET_SOUND) };
+}
+
+static inline Image get_image(Image_Handle handle)
+{
+    return asset_registry.assets[handle.index].image;
+}
+
+static inline Animated_Image get_animation(Animation_Handle handle)
+{
+    return asset_registry.assets[handle.index].animation;
+}
+
+static inline Font get_font(Font_Handle handle)
+{
+    return asset_registry.assets[handle.index].font;
+}
 
-    assets.heart_icon = read_image_file(PERSIST_POOL, "heart_icon.pam");
-    if (!assets.heart_icon.pixels) return false;
+static inline Sound get_sound(Sound_Handle handle)
+{
+    return asset_registry.assets[handle.index].sound;
+}
+
+//
+// Manifest.
+//
 
+// Returns the index of a name in a list of names, or -1.
+static int find_name(char ** names, int name_count, char * name)
+{
+    for (int i = 0; i < name_count; ++i)
     {
-        Image main_font_image = read_image_file(PERSIST_POOL, "font.pam");
-        if (!main_font_image.pixels) return false;
-        assets.main_font = (Font)
+        if (strcmp(names[i], name) == 0) return i;
+    }
+    return -1;
+}
+
+// Read a line of the manifest into an asset.
+// Returns false if the line is blank, a comment or cannot be read.
+bool parse_manifest_line(char * line, Asset * asset)
+{
+    char kind[32], group[32];
+    *asset = (Asset){};
+    int field_count = sscanf(line, "%31s %31s %31s %31s %d %d %d %d",
+        kind, asset->name, asset->file_name, group,
+        &asset->width, &asset->height,
+        &asset->frame_count, &asset->frame_duration_ms);
+    if (field_count < 1 || kind[0] == '#') return false;
+
+    int kind_index = find_name(asset_kind_names, ASSET_KIND_COUNT, kind);
+    int group_index = find_name(asset_group_names, ASSET_GROUP_COUNT, group);
+    if (field_count < 4 || kind_index < 0 || group_index < 0)
+    {
+        printf("Could not read manifest line: %s", line);
+        return false;
+    }
+    asset->kind = kind_index;
+    asset->group = group_index;
+    return true;
+}
+
+// Register every asset listed in a manifest file.
+// Returns false if the manifest could not be read.
+bool read_asset_manifest(char * file_name)
+{
+    FILE * file = fopen(file_name, "r");
+    if (!file) return false;
+    char line[256];
+    bool success = true;
+    while (fgets(line, sizeof(line), file) && success)
+    {
+        Asset asset;
+        if (parse_manifest_line(line, &asset))
         {
-            .pixels = main_font_image.pixels,
-            .char_width = 6,
-            .char_height = 12,
-        };
+            success = register_asset(&asset) != NULL;
+        }
     }
+    fclose(file);
+    return success;
+}
+
+//
+// Loading assets.
+//
 
+// Store an asset's data in the asset.
+// For images, animations and fonts the data is pixels in runtime order. The
+// width and height are of the image, of a single frame of an animation, or of
+// a single character of a font. For sounds, width is the number of samples.
+// frames is the frame table of an animation with trimmed frames, or NULL.
+// If there is a palette, the data of an image or animation is indices into it.
+void store_asset(Asset * asset, void * data, u32 * palette,
+    int width, int height, int frame_count, Animation_Frame * frames)
+{
+    switch (asset->kind)
     {
-        Image scream_font_image = read_image_file(PERSIST_POOL, "scream.pam");
-        if (!scream_font_image.pixels) return false;
-        assets.scream_font = (Font)
+        case ASSET_IMAGE:
         {
-            .pixels = scream_font_image.pixels,
-            .char_width = 9,
-            .char_height = 8,
-        };
+            asset->image = (Image){ data, width, height };
+            if (palette)
+            {
+                asset->image = (Image){ NULL, width, height, data, palette };
+            }
+        } break;
+
+        case ASSET_ANIMATION:
+        {
+            asset->animation = (Animated_Image)
+            {
+                .pixels = palette ? NULL : data,
+                .width = width,
+                .height = height,
+                .frame_count = frame_count,
+                .frame_duration_ms = asset->frame_duration_ms,
+                .frames = frames,
+                .indices = palette ? data : NULL,
+                .palette = palette,
+            };
+        } break;
+
+        case ASSET_FONT:
+        {
+            asset->font = (Font)
+            {
+                .pixels = data,
+                .char_width = width,
+                .char_height = height,
+            };
+        } break;
+
+        case ASSET_SOUND:
+        {
+            asset->sound = (Sound){ data, width };
+        } break;
+
+        default: break;
     }
+}
 
+// Load a single asset from its own file, in the current directory.
+// Returns false if the file could not be loaded.
+bool load_asset_file(int pool_index, Asset * asset)
+{
+    if (asset->kind == ASSET_SOUND)
+    {
+        Sound sound = read_raw_sound(pool_index, asset->file_name);
+        if (!sound.samples) return false;
+        store_asset(asset, sound.samples, NULL, sound.sample_count, 0, 0, NULL);
+        return true;
+    }
+
+    Image image = read_image_file(pool_index, asset->file_name);
+    if (!image.pixels) return false;
+    if (asset->kind == ASSET_ANIMATION)
+    {
+        int frame_count = max(asset->frame_count, 1);
+        store_asset(asset, image.pixels, NULL,
+            asset->width ? asset->width : image.width,
+            asset->height ? asset->height : image.height / frame_count,
+            frame_count, NULL);
+        asset->animation.coverage = find_animation_coverage(pool_index, asset->animation);
+        if (!asset->animation.coverage) return false;
+    }
+    else if (asset->kind == ASSET_FONT)
+    {
+        store_asset(asset, image.pixels, NULL, asset->width, asset->height, 0, NULL);
+    }
+    else
     {
-        Image button_image = read_image_file(PERSIST_POOL, "button.pam");
-        assets.button_animation = (Animated_Image)
+        store_asset(asset, image.pixels, NULL, image.width, image.height, 0, NULL);
+    }
+    return true;
+}
+
+//
+// Loading the asset archive.
+//
+
+// The archive that assets are loaded from, if there is one.
+u8 * asset_archive;
+u64 asset_archive_byte_count;
+
+// Returns true if count bytes from offset are within byte_count. This is
+// written so that it cannot overflow.
+static inline bool archive_range_fits(u64 offset, u64 count, u64 byte_count)
+{
+    return offset <= byte_count && count <= byte_count - offset;
+}
+
+// Check that an entry's data holds everything that will be read from it once
+// it is loaded, and that each trimmed frame is inside the full frame and the
+// data. The spans of delta encoded animations are checked when they are loaded
+// (see read_delta_animation).
+// Returns false if the entry is invalid.
+static bool check_archive_entry_data(Asset_Archive_Entry * entry,
+    u8 * archive, u64 byte_count)
+{
+    if (entry->encoding > ASSET_ENCODING_TRANSPOSED_LZ ||
+        !archive_range_fits(entry->offset, entry->byte_count, byte_count) ||
+        (entry->encoding == ASSET_ENCODING_RAW &&
+            entry->decoded_byte_count > entry->byte_count) ||
+        entry->width < 0 || entry->height < 0 || entry->frame_count < 0)
+    {
+        return false;
+    }
+    if (entry->kind == ASSET_SOUND)
+    {
+        return !entry->indexed &&
+            entry->decoded_byte_count >= (u64)entry->width * sizeof(f32);
+    }
+    if (entry->width > ASSET_ARCHIVE_MAX_SIZE ||
+        entry->height > ASSET_ARCHIVE_MAX_SIZE ||
+        entry->frame_count > ASSET_ARCHIVE_MAX_SIZE ||
+        (entry->kind == ASSET_FONT && entry->indexed))
+    {
+        return false;
+    }
+
+    u64 pixel_byte_count = entry->indexed ? 1 : sizeof(u32);
+    u64 data_byte_count = entry->decoded_byte_count;
+    if (entry->indexed)
+    {
+        if (data_byte_count < PALETTE_BYTE_COUNT) return false;
+        data_byte_count -= PALETTE_BYTE_COUNT;
+    }
+    u64 frame_pixel_count = (u64)entry->width * entry->height;
+    u64 pixel_count = frame_pixel_count;
+    if (entry->kind == ASSET_FONT)
+    {
+        // Every printable character, in a row (see draw_text).
+        pixel_count = 95 * frame_pixel_count;
+    }
+    else if (entry->kind == ASSET_ANIMATION && !entry->delta)
+    {
+        pixel_count = entry->frame_count * frame_pixel_count;
+    }
+
+    if (entry->kind == ASSET_ANIMATION && entry->frame_table_offset)
+    {
+        if (!archive_range_fits(entry->frame_table_offset,
+            entry->frame_count * sizeof(Animation_Frame), byte_count))
         {
-            .pixels = button_image.pixels,
-            .width = button_image.width,
-            .height = button_image.height / 2,
-            .frame_count = 2,
-            .frame_duration_ms = 10,
-        };
+            return false;
+        }
+        Animation_Frame * frames =
+            (Animation_Frame *)(archive + entry->frame_table_offset);
+        pixel_count = 0;
+        for (int i = 0; i < entry->frame_count; ++i)
+        {
+            Animation_Frame f = frames[i];
+            if (f.x < 0 || f.y < 0 || f.width < 0 || f.height < 0 ||
+                f.x + f.width > entry->width || f.y + f.height > entry->height)
+            {
+                return false;
+            }
+            pixel_count = max(pixel_count, f.pixel_offset + (u64)f.width * f.height);
+        }
     }
+    return pixel_count <= data_byte_count / pixel_byte_count;
+}
 
+// Use an archive that is already in memory, and register all of its assets.
+// Returns false if the archive is invalid.
+bool map_asset_archive(u8 * archive, u64 byte_count)
+{
+    Asset_Archive_Header * header = (Asset_Archive_Header *)archive;
+    if (byte_count < sizeof(Asset_Archive_Header) ||
+        !equal(header->magic, ASSET_ARCHIVE_MAGIC, sizeof(header->magic)) ||
+        header->version != ASSET_ARCHIVE_VERSION ||
+        sizeof(Asset_Archive_Header) +
+            header->entry_count * sizeof(Asset_Archive_Entry) > byte_count)
     {
-        Image heart_animation_image = read_image_file(PERSIST_POOL, "heart.pam");
-        if (!heart_animation_image.pixels) return false;
-        assets.heart_animation = (Animated_Image)
+        return false;
+    }
+
+    // Check every entry before registering any, so that a bad archive leaves
+    // the registry as it was (and loose files can be used instead).
+    Asset_Archive_Entry * entries =
+        (Asset_Archive_Entry *)(archive + sizeof(Asset_Archive_Header));
+    for (int i = 0; i < header->entry_count; ++i)
+    {
+        Asset_Archive_Entry * entry = &entries[i];
+        Asset_Archive_Entry * source = entry->source_entry ?
+            &entries[entry->source_entry - 1] : NULL;
+        if (!memchr(entry->name, '\0', ASSET_NAME_MAX) ||
+            !memchr(entry->file_name, '\0', ASSET_NAME_MAX) ||
+            entry->kind >= ASSET_KIND_COUNT ||
+            entry->group >= ASSET_GROUP_COUNT ||
+            entry->source_entry > header->entry_count ||
+            entry->source_entry == i + 1 ||
+            (entry->delta && (!entry->indexed || entry->kind != ASSET_ANIMATION)) ||
+            !check_archive_entry_data(entry, archive, byte_count))
         {
-            .pixels = heart_animation_image.pixels,
-            .width = 320,
-            .height = 200,
-            .frame_count = 7,
-        };
+            return false;
+        }
+        // A shared entry is loaded from its source's data when it can be.
+        if (source &&
+            (source->offset != entry->offset ||
+            source->encoding != entry->encoding ||
+            source->byte_count != entry->byte_count ||
+            source->decoded_byte_count != entry->decoded_byte_count ||
+            source->indexed != entry->indexed ||
+            source->delta != entry->delta))
+        {
+            return false;
+        }
     }
 
+    // Two entries could still have the same name.
+    int asset_count = asset_registry.asset_count;
+    for (int i = 0; i < header->entry_count; ++i)
     {
-        Image left_lung_animation_image = read_image_file(PERSIST_POOL, "left_lung.pam");
-        if (!left_lung_animation_image.pixels) return false;
-        assets.left_lung_animation = (Animated_Image)
+        Asset_Archive_Entry * entry = &entries[i];
+        Asset asset =
         {
-            .pixels = left_lung_animation_image.pixels,
-            .width = 85,
-            .height = 167,
-            .frame_count = 8,
+            .kind = entry->kind,
+            .group = entry->group,
+            .width = entry->width,
+            .height = entry->height,
+            .frame_count = entry->frame_count,
+            .frame_duration_ms = entry->frame_duration_ms,
+            .archive_entry = entry,
         };
+        copy_memory(entry->name, asset.name, ASSET_NAME_MAX);
+        copy_memory(entry->file_name, asset.file_name, ASSET_NAME_MAX);
+        if (!register_asset(&asset))
+        {
+            unregister_assets_after(asset_count);
+            return false;
+        }
     }
 
+    asset_archive = archive;
+    asset_archive_byte_count = byte_count;
+    return true;
+}
+
+// Map an asset archive file into memory, to load assets from.
+// Returns false if the archive could not be mapped.
+bool load_asset_archive(char * file_name)
+{
+#ifdef _WIN32
+    // No mmap, so read the whole file into the persistent pool instead.
+    FILE * file = fopen(file_name, "rb");
+    if (!file) return false;
+    fseek(file, 0, SEEK_END);
+    u64 byte_count = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    u8 * archive = pool_alloc(PERSIST_POOL, byte_count);
+    u64 bytes_read = archive ? fread(archive, 1, byte_count, file) : 0;
+    fclose(file);
+    if (bytes_read != byte_count) return false;
+#else
+    int file = open(file_name, O_RDONLY);
+    if (file < 0) return false;
+    struct stat file_stats;
+    if (fstat(file, &file_stats) != 0)
     {
-        Image right_lung_animation_image = read_image_file(PERSIST_POOL, "right_lung.pam");
-        if (!right_lung_animation_image.pixels) return false;
-        assets.right_lung_animation = (Animated_Image)
+        close(file);
+        return false;
+    }
+    u64 byte_count = file_stats.st_size;
+    // The mapping stays valid after the file is closed. It is read-only, so
+    // asset data must never be written to.
+    u8 * archive = mmap(NULL, byte_count, PROT_READ, MAP_SHARED, file, 0);
+    close(file);
+    if (archive == MAP_FAILED) return false;
+#endif
+    return map_asset_archive(archive, byte_count);
+}
+
+// Unregister every asset of the archive, and stop using it. None of its assets
+// can have been loaded yet.
+void unload_asset_archive()
+{
+    unregister_assets_after(1);
+#ifndef _WIN32
+    munmap(asset_archive, asset_archive_byte_count);
+#endif
+    asset_archive = NULL;
+    asset_archive_byte_count = 0;
+}
+
+// Returns true if the manifest, or the file of any asset in the archive, has
+// been changed since the archive was cooked. Files that are not there (when
+// only the archive is shipped) are ignored.
+bool asset_archive_is_stale(char * file_name)
+{
+    struct stat archive_stats;
+    struct stat file_stats;
+    if (stat(file_name, &archive_stats) != 0) return false;
+    if (stat(MANIFEST_FILE_NAME, &file_stats) == 0 &&
+        file_stats.st_mtime > archive_stats.st_mtime)
+    {
+        return true;
+    }
+    for (int i = 1; i < asset_registry.asset_count; ++i)
+    {
+        if (stat(asset_registry.assets[i].file_name, &file_stats) == 0 &&
+            file_stats.st_mtime > archive_stats.st_mtime)
         {
-            .pixels = right_lung_animation_image.pixels,
-            .width = 90,
-            .height = 167,
-            .frame_count = 8,
-        };
+            return true;
+        }
     }
+    return false;
+}
 
+// Find the parts of delta encoded animation data (after the palette), and
+// allocate a buffer to decode frames into.
+// Returns NULL if the data is invalid, or the buffer could not be allocated.
+Delta_Animation * read_delta_animation(int pool_index,
+    Asset_Archive_Entry * entry, u8 * data)
+{
+    u64 byte_count = entry->decoded_byte_count - PALETTE_BYTE_COUNT;
+    u64 frame_byte_count = entry->width * entry->height;
+    u64 frame_table_byte_count = entry->frame_count * sizeof(Delta_Frame);
+    if (entry->frame_count < 1 || frame_table_byte_count > byte_count) return NULL;
+
+    Delta_Frame * frames = (Delta_Frame *)data;
+    Delta_Frame last = frames[entry->frame_count - 1];
+    u64 span_count = (u64)last.first_span + last.span_count;
+    u64 span_table_byte_count = span_count * sizeof(Delta_Span);
+    if (frame_table_byte_count + span_table_byte_count + frame_byte_count > byte_count)
+    {
+        return NULL;
+    }
+    Delta_Span * spans = (Delta_Span *)(data + frame_table_byte_count);
+    u64 span_indices_count = byte_count -
+        (frame_table_byte_count + span_table_byte_count + frame_byte_count);
+
+    // Check that every span stays within the frame and the data.
+    for (int i = 0; i < entry->frame_count; ++i)
+    {
+        if ((u64)frames[i].first_span + frames[i].span_count > span_count) return NULL;
+    }
+    for (u64 i = 0; i < span_count; ++i)
     {
-        Image digestion_animation_image = read_image_file(PERSIST_POOL, "digestion.pam");
-        if (!digestion_animation_image.pixels) return false;
-        assets.digestion_animation = (Animated_Image)
+        Delta_Span span = spans[i];
+        if (span.x + span.length > entry->width || span.y >= entry->height ||
+            (u64)span.index_offset + span.length > span_indices_count)
         {
-            .pixels = digestion_animation_image.pixels,
-            .width = 85,
-            .height = 200,
-            .frame_count = 7,
-        };
+            return NULL;
+        }
+    }
+
+    Delta_Animation * delta = pool_alloc(pool_index,
+        sizeof(Delta_Animation) + frame_byte_count);
+    if (!delta) return NULL;
+    *delta = (Delta_Animation)
+    {
+        .frames = frames,
+        .spans = spans,
+        .keyframe = data + frame_table_byte_count + span_table_byte_count,
+        .span_indices = data + frame_table_byte_count + span_table_byte_count +
+            frame_byte_count,
+        .decoded = (u8 *)(delta + 1),
+        .decoded_frame = -1,
+    };
+    return delta;
+}
+
+// Load a single asset from the archive. Uncompressed data is used in place,
+// compressed data is decompressed into the given pool.
+// Returns false if the data could not be decompressed.
+bool load_archive_asset(int pool_index, Asset * asset)
+{
+    Asset_Archive_Entry * entry = asset->archive_entry;
+    u8 * data = asset_archive + entry->offset;
+    Asset * source = NULL;
+    if (entry->source_entry)
+    {
+        Asset_Archive_Entry * entries =
+            (Asset_Archive_Entry *)(asset_archive + sizeof(Asset_Archive_Header));
+        Asset_Archive_Entry * source_entry = &entries[entry->source_entry - 1];
+        source = &asset_registry.assets[find_asset(asset_id(source_entry->name),
+            source_entry->kind)];
+        // The source's data can only be shared if it is known to be loaded.
+        if (source->group != asset->group && source->group != ASSET_GROUP_SHARED)
+        {
+            source = NULL;
+        }
+    }
+    if (source && (source->animation.pixels || source->animation.palette))
+    {
+        // Indexed data starts with the palette.
+        data = entry->indexed ?
+            (u8 *)source->animation.palette : (u8 *)source->animation.pixels;
+    }
+    else if (entry->encoding != ASSET_ENCODING_RAW)
+    {
+        u8 * decoded = pool_alloc(pool_index, entry->decoded_byte_count);
+        if (!decoded ||
+            !lz_decompress(data, entry->byte_count, decoded, entry->decoded_byte_count))
+        {
+            return false;
+        }
+        if (entry->encoding == ASSET_ENCODING_TRANSPOSED_LZ)
+        {
+            untranspose_samples(decoded, entry->decoded_byte_count);
+        }
+        data = decoded;
+    }
+    u32 * palette = NULL;
+    if (entry->indexed)
+    {
+        palette = (u32 *)data;
+        data += PALETTE_BYTE_COUNT;
     }
+    store_asset(asset, data, palette,
+        entry->width, entry->height, entry->frame_count,
+        entry->frame_table_offset ?
+            (Animation_Frame *)(asset_archive + entry->frame_table_offset) : NULL);
+    if (asset->kind == ASSET_ANIMATION)
+    {
+        asset->animation.flip = entry->flip;
+        if (entry->delta)
+        {
+            asset->animation.delta = read_delta_animation(pool_index, entry, data);
+            if (!asset->animation.delta) return false;
+        }
+        asset->animation.coverage = find_animation_coverage(pool_index, asset->animation);
+        if (!asset->animation.coverage) return false;
+    }
+    return true;
+}
 
-    assets.shaker_sound = read_raw_sound(PERSIST_POOL, "shaker.f32");
-    if (!assets.shaker_sound.samples) return false;
+//
+// Writing the asset archive.
+//
 
-    assets.wood_block_sound = read_raw_sound(PERSIST_POOL, "woodblock.f32");
-    if (!assets.wood_block_sound.samples) return false;
+// An asset to be written into an archive. The entry's offsets are filled in
+// by write_asset_archive.
+typedef struct
+{
+    Asset_Archive_Entry entry;
+    void * data;
+    Animation_Frame * frames;
+    int source_index;   // One plus the index of the item whose data is shared.
+}
+Asset_Archive_Item;
 
-    assets.tap_sound = read_raw_sound(PERSIST_POOL, "tap.f32");
-    if (!assets.tap_sound.samples) return false;
+// Write padding up to the given offset, then byte_count bytes of data.
+static bool write_archive_data(FILE * file, u64 offset,
+    void * data, u64 byte_count)
+{
+    u8 padding[ASSET_ARCHIVE_ALIGNMENT] = {};
+    u64 padding_byte_count = offset - ftell(file);
+    return fwrite(padding, 1, padding_byte_count, file) == padding_byte_count &&
+        fwrite(data, 1, byte_count, file) == byte_count;
+}
 
-    assets.yay_sound = read_raw_sound(PERSIST_POOL, "yay.f32");
-    if (!assets.yay_sound.samples) return false;
+// Write a set of assets into an archive file.
+// Returns true if the entire archive was successfully written.
+bool write_asset_archive(char * file_name,
+    Asset_Archive_Item * items, int item_count)
+{
+    FILE * file = fopen(file_name, "wb");
+    if (!file) return false;
 
-    assets.clock_sound = read_raw_sound(PERSIST_POOL, "clock.f32");
-    if (!assets.clock_sound.samples) return false;
+    Asset_Archive_Header header = { .version = ASSET_ARCHIVE_VERSION };
+    copy_memory(ASSET_ARCHIVE_MAGIC, header.magic, sizeof(header.magic));
+    header.entry_count = item_count;
 
-    assets.brown_sound = read_raw_sound(PERSIST_POOL, "brown.f32");
-    if (!assets.brown_sound.samples) return false;
+    // Lay out the data after the table of contents.
+    u64 offset = align_archive_offset(sizeof(header) +
+        item_count * sizeof(Asset_Archive_Entry));
+    for (int i = 0; i < item_count; ++i)
+    {
+        Asset_Archive_Entry * entry = &items[i].entry;
+        entry->source_entry = items[i].source_index;
+        if (entry->source_entry)
+        {
+            Asset_Archive_Entry * source = &items[entry->source_entry - 1].entry;
+            entry->offset = source->offset;
+            entry->encoding = source->encoding;
+            entry->byte_count = source->byte_count;
+            entry->decoded_byte_count = source->decoded_byte_count;
+            entry->indexed = source->indexed;
+        }
+        else
+        {
+            entry->offset = offset;
+            offset = align_archive_offset(offset + entry->byte_count);
+        }
+        entry->frame_table_offset = 0;
+        if (items[i].frames)
+        {
+            entry->frame_table_offset = offset;
+            offset = align_archive_offset(offset +
+                entry->frame_count * sizeof(Animation_Frame));
+        }
+    }
 
-    return true;
+    bool success = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (int i = 0; i < item_count && success; ++i)
+    {
+        success = fwrite(&items[i].entry, sizeof(Asset_Archive_Entry), 1, file) == 1;
+    }
+    for (int i = 0; i < item_count && success; ++i)
+    {
+        Asset_Archive_Entry * entry = &items[i].entry;
+        if (!entry->source_entry)
+        {
+            success = write_archive_data(file, entry->offset,
+                items[i].data, entry->byte_count);
+        }
+        if (success && items[i].frames)
+        {
+            success = write_archive_data(file, entry->frame_table_offset,
+                items[i].frames, entry->frame_count * sizeof(Animation_Frame));
+        }
+    }
+    fclose(file);
+    return success;
+}
+
+//
+// Asset groups.
+//
+// Shared assets are loaded into the persistent pool at launch. The assets of a
+// scene's group are loaded into the scene pool when that scene starts, or
+// ahead of time on a background thread (see prefetch_asset_group). Loose
+// asset files can be loaded by a set of worker threads (and the calling
+// thread), each of which takes the next asset in the registry until there are
+// none left. The destination pool is shared while they run, and the time taken
+// to load each asset is recorded.
+//
+
+// Load a single asset, from the archive if it is in there, otherwise from its
+// own file in the current directory.
+// Returns false if the asset could not be loaded.
+bool load_asset(int pool_index, Asset * asset)
+{
+    if (asset->archive_entry) return load_archive_asset(pool_index, asset);
+    return load_asset_file(pool_index, asset);
+}
+
+// Returns true if the asset uses another asset's data, so has to be loaded after it.
+static inline bool asset_shares_data(Asset * asset)
+{
+    return asset->archive_entry && asset->archive_entry->source_entry;
+}
+
+#define MAX_ASSET_LOAD_THREADS 8
+
+typedef struct
+{
+    int next_asset_index;
+    int pool_index;
+    Asset_Group group;
+    bool failed;
+}
+Asset_Load_Jobs;
+
+int asset_load_worker(void * data)
+{
+    Asset_Load_Jobs * jobs = data;
+    f64 counter_ticks_per_ms = SDL_GetPerformanceFrequency() / 1000.0;
+    int asset_index;
+    while ((asset_index = __atomic_fetch_add(&jobs->next_asset_index,
+        1, __ATOMIC_RELAXED)) < asset_registry.asset_count)
+    {
+        Asset * asset = &asset_registry.assets[asset_index];
+        if (!asset->id || asset->group != jobs->group || asset_shares_data(asset))
+        {
+            continue;
+        }
+        u64 start_ticks = SDL_GetPerformanceCounter();
+        if (!load_asset(jobs->pool_index, asset))
+        {
+            __atomic_store_n(&jobs->failed, true, __ATOMIC_RELAXED);
+        }
+        asset->load_time_ms = (SDL_GetPerformanceCounter() - start_ticks)
+            / counter_ticks_per_ms;
+    }
+    return 0;
+}
+
+// Load every asset in a group into a pool, using thread_count worker threads
+// as well as the calling thread. Returns once all of them are done.
+// With no worker threads, the assets are always laid out in the pool in the
+// same order.
+// Returns false if any asset could not be loaded.
+bool load_asset_group(int pool_index, Asset_Group group, int thread_count)
+{
+    Asset_Load_Jobs jobs = { .pool_index = pool_index, .group = group };
+    SDL_Thread * threads[MAX_ASSET_LOAD_THREADS] = {};
+    thread_count = clamp(0, thread_count, MAX_ASSET_LOAD_THREADS);
+
+    if (thread_count) share_pool(pool_index, true);
+    for (int i = 0; i < thread_count; ++i)
+    {
+        // If a thread cannot be created the others take on its work.
+        threads[i] = SDL_CreateThread(asset_load_worker, "asset loader", &jobs);
+    }
+    asset_load_worker(&jobs);
+    for (int i = 0; i < thread_count; ++i)
+    {
+        if (threads[i]) SDL_WaitThread(threads[i], NULL);
+    }
+    if (thread_count) share_pool(pool_index, false);
+
+    // Now that everything else is loaded, load the assets that share data.
+    for (int i = 1; i < asset_registry.asset_count; ++i)
+    {
+        Asset * asset = &asset_registry.assets[i];
+        if (asset->group == group && asset_shares_data(asset) &&
+            !load_asset(pool_index, asset))
+        {
+            jobs.failed = true;
+        }
+    }
+
+    return !jobs.failed;
+}
+
+//
+// Prefetching.
+//
+// A group can be loaded into the scene pool by a background thread while the
+// game carries on, for example during the blank transition between scenes.
+// Nothing else may use the scene pool until finish_asset_prefetch is called, so
+// no snapshots are taken meanwhile, and load_scene_assets (which restoring a
+// snapshot goes through) waits for the prefetch first.
+//
+
+struct
+{
+    SDL_Thread * thread;
+    Asset_Group group;
+    bool succeeded;
+}
+asset_prefetch;
+
+int asset_prefetch_thread(void * data)
+{
+    asset_prefetch.succeeded = load_asset_group(SCENE_POOL, asset_prefetch.group, 0);
+    return 0;
+}
+
+// Start loading a group into the scene pool in the background.
+// Returns false if the thread could not be started.
+bool prefetch_asset_group(Asset_Group group)
+{
+    if (asset_prefetch.thread) return false;
+    asset_prefetch.group = group;
+    asset_prefetch.succeeded = false;
+    asset_prefetch.thread = SDL_CreateThread(asset_prefetch_thread,
+        "asset prefetch", NULL);
+    return asset_prefetch.thread != NULL;
+}
+
+// Wait for a prefetch to finish, if one was started.
+// Returns true if the given group is now loaded.
+bool finish_asset_prefetch(Asset_Group group)
+{
+    if (!asset_prefetch.thread) return false;
+    SDL_WaitThread(asset_prefetch.thread, NULL);
+    asset_prefetch.thread = NULL;
+    return asset_prefetch.succeeded && asset_prefetch.group == group;
+}
+
+#ifdef EMBED_ASSETS
+// The cooked asset archive, linked into the executable (see embed.c).
+extern u8 embedded_asset_archive[];
+extern u8 embedded_asset_archive_end[];
+#endif
+
+// Register all assets and load the shared ones, given a path relative to the
+// location of the executable (or app bundle). The cooked asset archive is used
+// if there is one, otherwise the manifest is read and each asset is loaded
+// from its own file. An archive that is older than the files it was cooked from
+// is not used, so that edits are not lost until the cooker is run again. When
+// the archive is embedded in the executable, no files are read at all.
+bool load_assets(char * assets_dir)
+{
+    if (!init_asset_registry(PERSIST_POOL)) return false;
+
+#ifdef EMBED_ASSETS
+    if (!map_asset_archive(embedded_asset_archive,
+        embedded_asset_archive_end - embedded_asset_archive))
+    {
+        return false;
+    }
+    return load_asset_group(PERSIST_POOL, ASSET_GROUP_SHARED, 0);
+#else
+    char * full_dir = pool_alloc(FRAME_POOL, 512);
+    char * base_path = SDL_GetBasePath();
+    snprintf(full_dir, 512, "%s%s", base_path, assets_dir ? assets_dir : "");
+    SDL_free(base_path);
+    chdir(full_dir);
+
+    bool archive_loaded = load_asset_archive(ASSET_ARCHIVE_FILE_NAME);
+    if (archive_loaded && asset_archive_is_stale(ASSET_ARCHIVE_FILE_NAME))
+    {
+        issue_warning("The asset files have changed since %s was cooked, so "
+            "they are loaded instead. Run the cooker to update it.",
+            ASSET_ARCHIVE_FILE_NAME);
+        unload_asset_archive();
+        archive_loaded = false;
+    }
+    if (!archive_loaded && !read_asset_manifest(MANIFEST_FILE_NAME)) return false;
+
+    // One worker per other CPU, as well as this thread.
+    return load_asset_group(PERSIST_POOL, ASSET_GROUP_SHARED, SDL_GetCPUCount() - 1);
+#endif
+}
+
+//
+// DEBUG:
+//
+
+void print_asset_load_times()
+{
+    printf("Asset Load Times:\n");
+    for (int i = 1; i < asset_registry.asset_count; ++i)
+    {
+        Asset * asset = &asset_registry.assets[i];
+        printf("%-22s %6.2fms\n", asset->name, asset->load_time_ms);
+    }
 }
@@ -141,11 +141,13 @@ void mix_audio(Mixer * mixer, void * stream, int samples_requested)
 int play_sound(Mixer * mixer, Sound sound,
     f32 left_gain, f32 right_gain, int loop)
 {
+    // The device is locked for the search too, so that two threads cannot
+    // both take the same free channel.
+    SDL_LockAudioDevice(audio_device);
     for (int i = 0; i < mixer->channel_count; ++i)
     {
         if (mixer->channels[i].samples == NULL)
         {
-            SDL_LockAudioDevice(audio_device);
             mixer->channels[i].samples      = sound.samples;
             mixer->channels[i].sample_count = sound.sample_count;
             mixer->channels[i].sample_index = 0;
@@ -157,6 +159,7 @@ int play_sound(Mixer * mixer, Sound sound,
             return i;
         }
     }
+    SDL_UnlockAudioDevice(audio_device);
     return -1;
 }
 
@@ -166,11 +169,11 @@ int play_sound(Mixer * mixer, Sound sound,
 int queue_sound(Mixer * mixer, Sound sound,
     f32 left_gain, f32 right_gain, bool loop)
 {
+    SDL_LockAudioDevice(audio_device);
     for (int i = 0; i < mixer->channel_count; ++i)
     {
         if (mixer->channels[i].samples == NULL)
         {
-            SDL_LockAudioDevice(audio_device);
             mixer->channels[i].samples      = sound.samples;
             mixer->channels[i].sample_count = sound.sample_count;
             mixer->channels[i].sample_index = 0;
@@ -182,6 +185,7 @@ int queue_sound(Mixer * mixer, Sound sound,
             return i;
         }
     }
+    SDL_UnlockAudioDevice(audio_device);
     return -1;
 }
 
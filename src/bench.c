@@ -0,0 +1,484 @@
+//
+// bench.c
+//
+// This file contains:
+//     - Scene benchmarks.
+//     - Timing statistics.
+//     - Result output and comparison.
+//
+
+//
+// Scene benchmarks.
+//
+// The bench build (build with -DBENCH) runs each scene without a display for
+// a number of frames, with presses scripted at a steady tempo, and reports how
+// long each phase of a frame took (see Bench_Phase). The tempo is a little off
+// from the scenes' own, so that no scene is completed and cut away from. The
+// game clock moves by a fixed step and the random seed is reset for each
+// scene, so the frames drawn are the same every run, and a hash of all of them
+// is given to show that a faster change still draws the same thing.
+//
+// Without a display, presenting is copying the frame to a buffer the size of
+// the screen texture, which is what SDL_UpdateTexture does.
+//
+// Options:
+//     --frames, --seconds and --fps are the same as for --platform headless.
+//     --out writes the results as JSON to a file.
+//     --baseline reads results written by --out, and fails the run if any
+//     scene's hash differs from it or if the median of any phase is slower by
+//     more than --threshold percent (10 by default).
+//
+
+#define BENCH_WARM_UP_FRAMES 60
+#define BENCH_BEATS_PER_MINUTE 70
+#define BENCH_PRESS_US 100000
+#define BENCH_DEFAULT_THRESHOLD 10.0
+// Phases shorter than this are too short to compare against a baseline.
+#define BENCH_MIN_COMPARED_US 5.0
+
+#ifndef PROFILE
+#error "The bench build times phases with the profiler's zones, so needs PROFILE."
+#endif
+
+//
+// Phases.
+//
+// The whole frame, presenting and audio are timed around the outside by the
+// bench loop. The other phases are added up from the zones (see profile.c)
+// that the main thread recorded during the frame. Phases do not nest: a zone
+// inside another one that belongs to a phase is counted as part of that one,
+// so text drawn by the interface is counted as interface rather than as text.
+//
+
+typedef enum
+{
+    BENCH_FRAME,
+    BENCH_NOISE,
+    BENCH_BLITS,
+    BENCH_UI,
+    BENCH_PRESENT,
+    BENCH_AUDIO,
+    BENCH_PHASE_COUNT,
+}
+Bench_Phase;
+
+struct
+{
+    char * zone_name;
+    Bench_Phase phase;
+}
+bench_phase_zones[] =
+{
+    { "draw_noise", BENCH_NOISE },
+    { "draw_image", BENCH_BLITS },
+    { "draw_overlay", BENCH_BLITS },
+    { "draw_text", BENCH_UI },
+    { "accuracy_interface", BENCH_UI },
+};
+
+#define BENCH_PHASE_ZONE_COUNT (sizeof(bench_phase_zones) / sizeof(bench_phase_zones[0]))
+
+char * bench_phase_names[BENCH_PHASE_COUNT] =
+{
+    [BENCH_FRAME] = "frame",
+    [BENCH_NOISE] = "noise",
+    [BENCH_BLITS] = "blits",
+    [BENCH_UI] = "ui",
+    [BENCH_PRESENT] = "present",
+    [BENCH_AUDIO] = "audio",
+};
+
+typedef struct
+{
+    char * name;
+    Scene * scene;
+    // The player that presses on each beat, repeating.
+    char * players;
+}
+Bench_Scene;
+
+Bench_Scene bench_scenes[] =
+{
+    { "heart", &heart_scene, "01" },
+    { "lungs", &lungs_scene, "01" },
+    { "digestion", &digestion_scene, "00001" },
+    { "blank", &blank_scene, "" },
+};
+
+#define BENCH_SCENE_COUNT (sizeof(bench_scenes) / sizeof(bench_scenes[0]))
+
+// Times in microseconds.
+typedef struct
+{
+    f64 p50;
+    f64 p95;
+    f64 p99;
+    f64 max;
+}
+Bench_Stats;
+
+typedef struct
+{
+    Bench_Stats phases[BENCH_PHASE_COUNT];
+    u64 frame_hash;
+    bool left_scene;
+}
+Bench_Result;
+
+// Set up a scene as if it had just been cut to, with nothing left over from
+// the one before.
+void start_bench_scene(Bench_Scene * bench_scene, f32 seconds)
+{
+    random_seed[0] = 0x9e3779b97f4a7c15ull;
+    random_seed[1] = 0xbf58476d1ce4e5b9ull;
+    set_memory(mixer.channels, mixer.channel_count * sizeof(Mixer_Channel), 0);
+    start_game_clock();
+    next_snapshot_time_ms = SNAPSHOT_INTERVAL_MS;
+
+    if (bench_scene->scene == &blank_scene)
+    {
+        // Stay blank for longer than the run.
+        prepare_blank_cut(seconds + 1.0, 0, &heart_scene, NULL);
+    }
+    set_scene(*bench_scene->scene);
+
+    heart_state.draw_interface = true;
+    lungs_state.draw_interface = true;
+    digestion_state.draw_interface = true;
+}
+
+// Send the presses and releases that are due between two real clock times.
+void send_bench_input(Bench_Scene * bench_scene, u64 from_us, u64 to_us)
+{
+    int player_count = strlen(bench_scene->players);
+    if (!player_count) return;
+    u64 beat_us = 60000000 / BENCH_BEATS_PER_MINUTE;
+    for (u64 beat = from_us / beat_us; beat * beat_us < to_us; ++beat)
+    {
+        int player = bench_scene->players[beat % player_count] - '0';
+        u64 times_us[2] = { beat * beat_us, beat * beat_us + BENCH_PRESS_US };
+        for (int pressed = 1; pressed >= 0; --pressed)
+        {
+            u64 time_us = times_us[!pressed];
+            if (time_us < from_us || time_us >= to_us) continue;
+            if (current_scene.feedback) current_scene.feedback(player, pressed);
+            current_scene.input(current_scene.state, player, pressed,
+                game_clock.start_us + time_us);
+        }
+    }
+}
+
+// Add the time of the zones that the main thread has recorded since there
+// were first_event_count of them to the phases they belong to.
+void add_bench_phase_times(u64 first_event_count, u64 * phase_ns)
+{
+    Profile_Ring * ring = &profiler.rings[0];
+    u64 event_count = ring->event_count;
+    if (event_count - first_event_count > PROFILE_EVENTS_PER_THREAD)
+    {
+        first_event_count = event_count - PROFILE_EVENTS_PER_THREAD;
+    }
+
+    // Zones are recorded as they end, so going backwards, any zone that others
+    // are inside comes before them.
+    u64 outer_start_ns = 0;
+    u64 outer_end_ns = 0;
+    for (u64 i = event_count; i-- > first_event_count;)
+    {
+        Profile_Event event = ring->events[i & (PROFILE_EVENTS_PER_THREAD - 1)];
+        u64 end_ns = event.start_ns + event.duration_ns;
+        if (event.start_ns >= outer_start_ns && end_ns <= outer_end_ns) continue;
+        for (int zone = 0; zone < BENCH_PHASE_ZONE_COUNT; ++zone)
+        {
+            if (strcmp(event.name, bench_phase_zones[zone].zone_name) == 0)
+            {
+                phase_ns[bench_phase_zones[zone].phase] += event.duration_ns;
+                outer_start_ns = event.start_ns;
+                outer_end_ns = end_ns;
+                break;
+            }
+        }
+    }
+}
+
+//
+// Timing statistics.
+//
+
+static int compare_u64(const void * a, const void * b)
+{
+    u64 x = *(u64 *)a;
+    u64 y = *(u64 *)b;
+    return (x > y) - (x < y);
+}
+
+// The nearest rank percentile of some sorted samples.
+static f64 get_percentile_us(u64 * sorted_ns, u64 count, f64 percentile)
+{
+    u64 rank = ceil(percentile * count);
+    return sorted_ns[clamp(1, rank, count) - 1] / 1000.0;
+}
+
+// Sorts the samples.
+Bench_Stats get_bench_stats(u64 * samples_ns, u64 count)
+{
+    qsort(samples_ns, count, sizeof(u64), compare_u64);
+    return (Bench_Stats){
+        get_percentile_us(samples_ns, count, 0.50),
+        get_percentile_us(samples_ns, count, 0.95),
+        get_percentile_us(samples_ns, count, 0.99),
+        get_percentile_us(samples_ns, count, 1.00),
+    };
+}
+
+// Run one scene for a number of frames and time each phase of every frame.
+// samples_ns is space for frame_count samples of every phase.
+Bench_Result run_bench_scene(Bench_Scene * bench_scene, u64 frame_count,
+    int frames_per_second, u64 * samples_ns, u32 * present_pixels)
+{
+    Bench_Result result = {};
+    u64 frame_step_us = 1000000 / frames_per_second;
+    start_bench_scene(bench_scene,
+        (f32)(frame_count + BENCH_WARM_UP_FRAMES) / frames_per_second);
+
+    for (u64 i = 0; i < frame_count + BENCH_WARM_UP_FRAMES; ++i)
+    {
+        u64 previous_time_us = game_clock.real_time_us;
+        advance_game_clock(frame_step_us);
+        send_bench_input(bench_scene, previous_time_us, game_clock.real_time_us);
+
+        u64 phase_ns[BENCH_PHASE_COUNT] = {};
+        u64 first_event_count = profiler.rings[0].event_count;
+        u64 start_ns = get_time_ns();
+        run_frame();
+        u64 rendered_ns = get_time_ns();
+        memcpy(present_pixels, pixels, WIDTH * HEIGHT * sizeof(u32));
+        u64 presented_ns = get_time_ns();
+        mix_audio_offline();
+        u64 mixed_ns = get_time_ns();
+        phase_ns[BENCH_FRAME] = rendered_ns - start_ns;
+        phase_ns[BENCH_PRESENT] = presented_ns - rendered_ns;
+        phase_ns[BENCH_AUDIO] = mixed_ns - presented_ns;
+        add_bench_phase_times(first_event_count, phase_ns);
+
+        if (current_scene.update != bench_scene->scene->update)
+        {
+            result.left_scene = true;
+        }
+        if (i < BENCH_WARM_UP_FRAMES) continue;
+
+        u64 frame_index = i - BENCH_WARM_UP_FRAMES;
+        for (int phase = 0; phase < BENCH_PHASE_COUNT; ++phase)
+        {
+            samples_ns[phase * frame_count + frame_index] = phase_ns[phase];
+        }
+        result.frame_hash = hash_bytes(pixels, WIDTH * HEIGHT * sizeof(u32),
+            result.frame_hash);
+    }
+
+    for (int phase = 0; phase < BENCH_PHASE_COUNT; ++phase)
+    {
+        result.phases[phase] = get_bench_stats(samples_ns + phase * frame_count,
+            frame_count);
+    }
+    return result;
+}
+
+//
+// Result output and comparison.
+//
+
+void write_bench_json(FILE * file, Bench_Result * results, u64 frame_count,
+    int frames_per_second)
+{
+    fprintf(file, "{\n");
+    fprintf(file, "  \"frames\": %llu,\n", (unsigned long long)frame_count);
+    fprintf(file, "  \"fps\": %d,\n", frames_per_second);
+    fprintf(file, "  \"scenes\": [\n");
+    for (int i = 0; i < BENCH_SCENE_COUNT; ++i)
+    {
+        fprintf(file, "    {\n");
+        fprintf(file, "      \"name\": \"%s\",\n", bench_scenes[i].name);
+        fprintf(file, "      \"hash\": \"%016llx\",\n",
+            (unsigned long long)results[i].frame_hash);
+        fprintf(file, "      \"phases\": {\n");
+        for (int phase = 0; phase < BENCH_PHASE_COUNT; ++phase)
+        {
+            Bench_Stats stats = results[i].phases[phase];
+            fprintf(file, "        \"%s\": { \"p50\": %.3f, \"p95\": %.3f, "
+                "\"p99\": %.3f, \"max\": %.3f }%s\n",
+                bench_phase_names[phase], stats.p50, stats.p95, stats.p99, stats.max,
+                phase + 1 < BENCH_PHASE_COUNT ? "," : "");
+        }
+        fprintf(file, "      }\n");
+        fprintf(file, "    }%s\n", i + 1 < BENCH_SCENE_COUNT ? "," : "");
+    }
+    fprintf(file, "  ]\n");
+    fprintf(file, "}\n");
+}
+
+void print_bench_results(Bench_Result * results)
+{
+    printf("Scene Benchmarks (microseconds):\n");
+    printf("%-10s %-8s %10s %10s %10s %10s\n",
+        "scene", "phase", "p50", "p95", "p99", "max");
+    for (int i = 0; i < BENCH_SCENE_COUNT; ++i)
+    {
+        for (int phase = 0; phase < BENCH_PHASE_COUNT; ++phase)
+        {
+            Bench_Stats stats = results[i].phases[phase];
+            printf("%-10s %-8s %10.1f %10.1f %10.1f %10.1f\n",
+                phase == 0 ? bench_scenes[i].name : "", bench_phase_names[phase],
+                stats.p50, stats.p95, stats.p99, stats.max);
+        }
+        printf("%-10s %-8s %016llx\n", "", "hash", (unsigned long long)results[i].frame_hash);
+    }
+}
+
+// Read a whole file into a pool, with a terminating zero.
+// Returns NULL if the file could not be read.
+char * read_bench_file(int pool_index, char * file_name)
+{
+    FILE * file = fopen(file_name, "rb");
+    if (!file) return NULL;
+    fseek(file, 0, SEEK_END);
+    long byte_count = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char * text = byte_count >= 0 ? pool_alloc(pool_index, byte_count + 1) : NULL;
+    if (text && fread(text, 1, byte_count, file) == byte_count)
+    {
+        text[byte_count] = 0;
+    }
+    else
+    {
+        text = NULL;
+    }
+    fclose(file);
+    return text;
+}
+
+// Compare results against a baseline written by write_bench_json. Only what
+// write_bench_json writes is understood.
+// Returns the number of regressions found.
+int compare_bench_results(Bench_Result * results, char * baseline, f64 threshold)
+{
+    int regression_count = 0;
+    for (int i = 0; i < BENCH_SCENE_COUNT; ++i)
+    {
+        char pattern[64];
+        snprintf(pattern, sizeof(pattern), "\"name\": \"%s\"", bench_scenes[i].name);
+        char * scene = strstr(baseline, pattern);
+        unsigned long long hash;
+        if (!scene || !(scene = strstr(scene, "\"hash\": \"")) ||
+            sscanf(scene, "\"hash\": \"%llx\"", &hash) != 1)
+        {
+            printf("%s: not in the baseline.\n", bench_scenes[i].name);
+            continue;
+        }
+        if (hash != results[i].frame_hash)
+        {
+            printf("%s: frames differ from the baseline (%016llx, was %016llx).\n",
+                bench_scenes[i].name, (unsigned long long)results[i].frame_hash, hash);
+            ++regression_count;
+        }
+
+        for (int phase = 0; phase < BENCH_PHASE_COUNT; ++phase)
+        {
+            snprintf(pattern, sizeof(pattern), "\"%s\": { \"p50\": ",
+                bench_phase_names[phase]);
+            char * stats = strstr(scene, pattern);
+            f64 baseline_us;
+            if (!stats || sscanf(stats + strlen(pattern), "%lf", &baseline_us) != 1)
+            {
+                continue;
+            }
+            if (baseline_us < BENCH_MIN_COMPARED_US) continue;
+            f64 change = (results[i].phases[phase].p50 / baseline_us - 1.0) * 100.0;
+            if (change > threshold)
+            {
+                printf("%s: %s is %.1f%% slower than the baseline (%.1fus, was %.1fus).\n",
+                    bench_scenes[i].name, bench_phase_names[phase], change,
+                    results[i].phases[phase].p50, baseline_us);
+                ++regression_count;
+            }
+        }
+    }
+    return regression_count;
+}
+
+// Run every scene benchmark, then write and compare the results.
+// Returns the exit code for the program.
+int run_bench(u64 frame_count, int frames_per_second,
+    int argument_count, char ** arguments)
+{
+    char * out_file_name = NULL;
+    char * baseline_file_name = NULL;
+    f64 threshold = BENCH_DEFAULT_THRESHOLD;
+    for (int i = 1; i < argument_count; ++i)
+    {
+        if (strcmp(arguments[i], "--out") == 0 && i + 1 < argument_count)
+        {
+            out_file_name = arguments[++i];
+        }
+        else if (strcmp(arguments[i], "--baseline") == 0 && i + 1 < argument_count)
+        {
+            baseline_file_name = arguments[++i];
+        }
+        else if (strcmp(arguments[i], "--threshold") == 0 && i + 1 < argument_count)
+        {
+            threshold = atof(arguments[++i]);
+        }
+    }
+
+    char * baseline = NULL;
+    if (baseline_file_name)
+    {
+        baseline = read_bench_file(PERSIST_POOL, baseline_file_name);
+        if (!baseline)
+        {
+            panic_exit("Could not read the baseline %s.", baseline_file_name);
+        }
+    }
+
+    u64 * samples_ns = pool_alloc(PERSIST_POOL,
+        frame_count * BENCH_PHASE_COUNT * sizeof(u64));
+    u32 * present_pixels = pool_alloc(PERSIST_POOL, WIDTH * HEIGHT * sizeof(u32));
+    if (!frame_count || !samples_ns || !present_pixels)
+    {
+        panic_exit("Could not allocate space for %llu frames of timings.",
+            (unsigned long long)frame_count);
+    }
+
+    Bench_Result results[BENCH_SCENE_COUNT];
+    bool left_scene = false;
+    for (int i = 0; i < BENCH_SCENE_COUNT; ++i)
+    {
+        results[i] = run_bench_scene(&bench_scenes[i], frame_count,
+            frames_per_second, samples_ns, present_pixels);
+        if (results[i].left_scene)
+        {
+            printf("%s: the scene ended during the run.\n", bench_scenes[i].name);
+            left_scene = true;
+        }
+    }
+
+    print_bench_results(results);
+
+    if (out_file_name)
+    {
+        FILE * file = fopen(out_file_name, "w");
+        if (!file) panic_exit("Could not write the results to %s.", out_file_name);
+        write_bench_json(file, results, frame_count, frames_per_second);
+        fclose(file);
+    }
+
+    int regression_count = 0;
+    if (baseline)
+    {
+        regression_count = compare_bench_results(results, baseline, threshold);
+        printf(regression_count ? "%d regressions from the baseline.\n" :
+            "No regressions from the baseline.\n", regression_count);
+    }
+
+    return (regression_count || left_scene) ? 1 : 0;
+}
@@ -1,17 +1,67 @@
 # Build script for rhythm
 # Benedict Henshaw, 2018
-# Uncomment the line for your platform.
+# Uncomment the lines for your platform.
 
 # Common flags.
 FLAGS="main.c -o rhythm -Wall"
 
+# On x86 CPUs that have AVX2, indexed sprites can be drawn with gathers.
+# FLAGS="$FLAGS -mavx2"
+
+# The asset cooker, which packs ../assets/ into ../assets/assets.pack.
+COOKER_FLAGS="cooker.c -o cooker -Wall"
+
+# To embed the cooked assets in the executable, so that no asset files are read
+# at run time, uncomment these lines. The archive is cooked without compression
+# so that the assets can be used straight from the executable's data.
+# EMBED="./cooker && clang -c embed.c -o embed.o"
+# FLAGS="$FLAGS embed.o -DEMBED_ASSETS"
+
+# To also build the scene benchmarks (see bench.c) and the microbenchmarks (see
+# microbench.c), uncomment this line. Run ./bench --out results.json, and later
+# ./bench --baseline results.json to fail if anything has become slower. The
+# bench times its phases with the profiler, so is built with PROFILE.
+# BENCH=1
+BENCH_FLAGS="main.c -o bench -Wall -O2 -DBENCH -DPROFILE"
+MICROBENCH_FLAGS="microbench.c -o microbench -Wall -O2"
+
+# On Linux, the evdev input backend (see input.c) can be checked against a
+# virtual keyboard by running ./evdev_check as root (see evdev_check.c).
+EVDEV_CHECK_FLAGS="evdev_check.c -o evdev_check -Wall"
+
+# To check that a recorded session replays the same (see replay.c) before
+# running the game, uncomment this line. Twenty seconds of play ends inside the
+# first scene, rather than in the blank cut before it, so the scene's state
+# (and any assets it holds) is part of what is checked.
+# CHECK_REPLAY=1
+
 # macOS (clang)
+clang $COOKER_FLAGS -framework SDL2
+[[ -n "$EMBED" ]] && eval "$EMBED"
+[[ -n "$BENCH" ]] && clang $BENCH_FLAGS -framework SDL2
+[[ -n "$BENCH" ]] && clang $MICROBENCH_FLAGS -framework SDL2
 clang $FLAGS -framework SDL2
 
+# Linux (gcc)
+# gcc $COOKER_FLAGS -lSDL2 -lm
+# [[ -n "$EMBED" ]] && eval "${EMBED//clang/gcc}"
+# [[ -n "$BENCH" ]] && gcc $BENCH_FLAGS -lSDL2 -lm
+# [[ -n "$BENCH" ]] && gcc $MICROBENCH_FLAGS -lSDL2 -lm
+# gcc $EVDEV_CHECK_FLAGS -lSDL2
+# gcc $FLAGS -lSDL2 -lm
+
 # windows (MinGW)
+# gcc $COOKER_FLAGS -lmingw32 -lSDL2main -lSDL2
+# [[ -n "$EMBED" ]] && eval "${EMBED//clang/gcc}"
+# [[ -n "$BENCH" ]] && gcc $BENCH_FLAGS -lmingw32 -lSDL2main -lSDL2
+# [[ -n "$BENCH" ]] && gcc $MICROBENCH_FLAGS -lmingw32 -lSDL2main -lSDL2
 # gcc $FLAGS -mwindows -lmingw32 -lSDL2main -lSDL2
 
 # Run on successful build.
 if [[ $? -eq 0 ]]; then
+    if [[ -n "$CHECK_REPLAY" ]]; then
+        ./rhythm --platform headless --seconds 20 --record "$PWD/replay_check.rp" &&
+            ./rhythm --replay "$PWD/replay_check.rp" || exit 1
+    fi
     ./rhythm
 fi
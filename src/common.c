@@ -4,6 +4,8 @@
 // This file contains:
 //     - Primitive type definitions.
 //     - Pseudo-random number generator and utilities.
+//     - High resolution clock and sleeping.
+//     - Game clock.
 //     - Error reporting functions.
 //
 
@@ -37,6 +39,18 @@ typedef _Bool bool;
 #define max(a, b) (((a) > (b)) ? (a) : (b))
 #define clamp(low, value, high) max(low, (min(value, high)))
 
+// Hash some bytes, continuing from a previous hash (or zero to start).
+// (64-bit FNV-1a)
+u64 hash_bytes(void * data, u64 byte_count, u64 hash)
+{
+    if (!hash) hash = 14695981039346656037ull;
+    for (u64 i = 0; i < byte_count; ++i)
+    {
+        hash = (hash ^ ((u8 *)data)[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
 //
 // Pseudo-random number generator.
 // (Xoroshiro128+)
@@ -98,6 +112,137 @@ bool chance(f32 chance_to_be_true)
     return random_f32() <= chance_to_be_true;
 }
 
+//
+// Clock.
+//
+// Times are in nanoseconds from CLOCK_MONOTONIC, which is not changed by the
+// system clock being set. On Linux sleep_until_ns sleeps to an absolute time,
+// so being woken late for one frame does not push back every frame after it.
+//
+
+u64 get_time_ns()
+{
+#ifdef _WIN32
+    return SDL_GetPerformanceCounter() * (1000000000.0 / SDL_GetPerformanceFrequency());
+#else
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000000000ull + time.tv_nsec;
+#endif
+}
+
+u64 get_time_us()
+{
+    return get_time_ns() / 1000;
+}
+
+// Sleep until about time_ns. May wake up late, but never early.
+void sleep_until_ns(u64 time_ns)
+{
+#if defined(__linux__)
+    struct timespec time = { time_ns / 1000000000ull, time_ns % 1000000000ull };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &time, NULL) == EINTR);
+#else
+    u64 now_ns = get_time_ns();
+    if (now_ns >= time_ns) return;
+#ifdef _WIN32
+    SDL_Delay((time_ns - now_ns) / 1000000);
+#else
+    u64 wait_ns = time_ns - now_ns;
+    struct timespec time = { wait_ns / 1000000000ull, wait_ns % 1000000000ull };
+    nanosleep(&time, NULL);
+#endif
+#endif
+}
+
+//
+// Game clock.
+//
+// Everything in the game that goes by time reads the game clock rather than
+// the real one. The real clock is sampled once per frame, by step_game_clock,
+// so the time is the same everywhere in a frame and animations drawn in the
+// same frame can not disagree. A record of how far the clock was stepped each
+// frame is enough to play the game again exactly (see replay.c).
+//
+// Game time can be scaled and paused, for looking at animations closely. Real
+// time keeps going either way, as input time stamps and audio go by it.
+//
+
+struct
+{
+    // The real time that the clock started at.
+    u64 start_us;
+    // Real time since the clock started, when it was last stepped.
+    u64 real_time_us;
+    // Game time, which moves at scale times real time, unless paused.
+    u64 time_us;
+    // How far each moved at the last step.
+    u64 real_delta_us;
+    u64 delta_us;
+    f64 scale;
+    bool paused;
+}
+game_clock = { .scale = 1.0 };
+
+void start_game_clock()
+{
+    game_clock.start_us = get_time_us();
+    game_clock.real_time_us = 0;
+    game_clock.time_us = 0;
+    game_clock.real_delta_us = 0;
+    game_clock.delta_us = 0;
+    game_clock.scale = 1.0;
+    game_clock.paused = false;
+}
+
+// Move the game clock on by an amount of real time.
+void advance_game_clock(u64 real_delta_us)
+{
+    game_clock.real_time_us += real_delta_us;
+    game_clock.real_delta_us = real_delta_us;
+    game_clock.delta_us = game_clock.paused ? 0 : real_delta_us * game_clock.scale;
+    game_clock.time_us += game_clock.delta_us;
+}
+
+// Move the game clock up to the real time. Call once per frame.
+void step_game_clock()
+{
+    u64 real_time_us = get_time_us() - game_clock.start_us;
+    advance_game_clock(real_time_us - min(real_time_us, game_clock.real_time_us));
+}
+
+void set_game_clock_scale(f64 scale)
+{
+    game_clock.scale = clamp(1.0 / 16.0, scale, 16.0);
+}
+
+void set_game_clock_paused(bool paused)
+{
+    game_clock.paused = paused;
+}
+
+// The game time in milliseconds.
+u32 get_ticks()
+{
+    return game_clock.time_us / 1000;
+}
+
+// The game time in seconds, for smooth animation.
+f64 get_game_time()
+{
+    return game_clock.time_us / 1000000.0;
+}
+
+// Convert a real time (such as an input time stamp) to game time in
+// microseconds. Times after the last step are treated as happening then.
+u64 real_to_game_time_us(u64 real_time_us)
+{
+    u64 now_us = game_clock.start_us + game_clock.real_time_us;
+    if (game_clock.paused || real_time_us >= now_us) return game_clock.time_us;
+    u64 scaled_age_us = (now_us - real_time_us) * game_clock.scale;
+    return game_clock.time_us - min(scaled_age_us, game_clock.time_us);
+}
+
 //
 // Error reporting.
 //
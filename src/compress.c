@@ -0,0 +1,268 @@
+//
+// compress.c
+//
+// This file contains:
+//     - LZ byte compressor and decompressor.
+//     - Sample block transposition for compressing audio.
+//
+
+//
+// LZ compression.
+//
+// A simple LZ77 byte codec in the style of LZ4. The compressed data is a
+// sequence of runs, each of which is a token byte, some literal bytes to be
+// copied, and a match that repeats bytes that have already been written. The
+// high four bits of the token are the literal count and the low four bits are
+// the match length (minus LZ_MIN_MATCH). A value of 15 in either means more
+// bytes of length follow, each added on until one is less than 255. A match is
+// given as a 16-bit little-endian offset back from the current position. The
+// final run has only literals.
+//
+// Decompression does no more than copy bytes around, so it is faster than
+// reading the uncompressed data from disk.
+//
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+// No match may start within this many bytes of the end.
+#define LZ_END_LITERALS 12
+
+// The most bytes that compressing byte_count bytes can produce.
+static inline u64 lz_compress_bound(u64 byte_count)
+{
+    return byte_count + byte_count / 255 + 16;
+}
+
+static inline u32 lz_read_u32(u8 * p)
+{
+    u32 value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline u32 lz_hash(u32 sequence)
+{
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Write a length that did not fit in a token nibble.
+static inline u8 * lz_write_length(u8 * out, u64 length)
+{
+    while (length >= 255)
+    {
+        *out++ = 255;
+        length -= 255;
+    }
+    *out++ = length;
+    return out;
+}
+
+// Compress byte_count bytes of src into dest, which must have room for
+// lz_compress_bound(byte_count) bytes.
+// Returns the number of bytes written to dest.
+u64 lz_compress(u8 * src, u64 byte_count, u8 * dest)
+{
+    // Positions are stored plus one, so that zero means empty.
+    u32 table[1 << LZ_HASH_BITS] = {};
+    u8 * out = dest;
+    u64 anchor = 0;
+    u64 i = 0;
+
+    while (byte_count > LZ_END_LITERALS && i < byte_count - LZ_END_LITERALS)
+    {
+        u32 sequence = lz_read_u32(src + i);
+        u32 hash = lz_hash(sequence);
+        u64 candidate = table[hash];
+        table[hash] = i + 1;
+        if (!candidate || i - (candidate - 1) > LZ_MAX_OFFSET ||
+            lz_read_u32(src + candidate - 1) != sequence)
+        {
+            ++i;
+            continue;
+        }
+        --candidate;
+
+        u64 match_length = LZ_MIN_MATCH;
+        while (i + match_length < byte_count - LZ_END_LITERALS &&
+            src[candidate + match_length] == src[i + match_length])
+        {
+            ++match_length;
+        }
+
+        // Emit the literals since the last match, then the match.
+        u64 literal_count = i - anchor;
+        u64 extra_match = match_length - LZ_MIN_MATCH;
+        u8 * token = out++;
+        *token = (min(literal_count, 15) << 4) | min(extra_match, 15);
+        if (literal_count >= 15) out = lz_write_length(out, literal_count - 15);
+        memcpy(out, src + anchor, literal_count);
+        out += literal_count;
+        u64 offset = i - candidate;
+        *out++ = offset & 0xff;
+        *out++ = offset >> 8;
+        if (extra_match >= 15) out = lz_write_length(out, extra_match - 15);
+
+        i += match_length;
+        anchor = i;
+    }
+
+    // The final run is all literals.
+    u64 literal_count = byte_count - anchor;
+    *out++ = min(literal_count, 15) << 4;
+    if (literal_count >= 15) out = lz_write_length(out, literal_count - 15);
+    memcpy(out, src + anchor, literal_count);
+    out += literal_count;
+
+    return out - dest;
+}
+
+// Read a length that did not fit in a token nibble.
+// Returns false if it runs off the end of the input.
+static inline bool lz_read_length(u8 ** in, u8 * in_end, u64 * length)
+{
+    u8 byte;
+    do
+    {
+        if (*in >= in_end) return false;
+        byte = *(*in)++;
+        *length += byte;
+    }
+    while (byte == 255);
+    return true;
+}
+
+// Decompress src into exactly byte_count bytes of dest.
+// Returns false if the compressed data is invalid.
+bool lz_decompress(u8 * src, u64 src_byte_count, u8 * dest, u64 byte_count)
+{
+    u8 * in = src;
+    u8 * in_end = src + src_byte_count;
+    u8 * out = dest;
+    u8 * out_end = dest + byte_count;
+
+    while (in < in_end)
+    {
+        u8 token = *in++;
+
+        u64 literal_count = token >> 4;
+        if (literal_count == 15 && !lz_read_length(&in, in_end, &literal_count))
+        {
+            return false;
+        }
+        if (literal_count > in_end - in || literal_count > out_end - out)
+        {
+            return false;
+        }
+        memcpy(out, in, literal_count);
+        in += literal_count;
+        out += literal_count;
+
+        // The final run has no match.
+        if (in == in_end) break;
+
+        if (in_end - in < 2) return false;
+        u64 offset = in[0] | (in[1] << 8);
+        in += 2;
+        u64 match_length = (token & 15);
+        if (match_length == 15 && !lz_read_length(&in, in_end, &match_length))
+        {
+            return false;
+        }
+        match_length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > out - dest || match_length > out_end - out)
+        {
+            return false;
+        }
+
+        // Matches may overlap the bytes being written, so only copy in
+        // chunks when the offset is at least as large as the chunk.
+        u8 * match = out - offset;
+        if (offset >= 8)
+        {
+            while (match_length >= 8)
+            {
+                memcpy(out, match, 8);
+                out += 8;
+                match += 8;
+                match_length -= 8;
+            }
+        }
+        while (match_length--) *out++ = *match++;
+    }
+
+    return out == out_end;
+}
+
+//
+// Sample transposition.
+//
+// The bytes of neighbouring f32 samples have little in common, but the bytes
+// in the same position of each sample (mostly the sign and exponent) do. So
+// before compressing, samples are split into blocks, and each block is
+// rearranged into four planes: the first byte of every sample, then the second
+// byte and so on. Each plane then stores the difference from the previous
+// byte, which turns slowly changing bytes into runs of small numbers that LZ
+// compresses well. Working in blocks means that the samples can be restored
+// in place, straight into the memory they will be used from.
+//
+
+#define SAMPLE_BLOCK_COUNT 256
+
+// Transpose a block of sample_count samples into byte planes.
+static void transpose_sample_block(u8 * src, u8 * dest, int sample_count)
+{
+    for (int plane = 0; plane < sizeof(f32); ++plane)
+    {
+        u8 previous = 0;
+        for (int i = 0; i < sample_count; ++i)
+        {
+            u8 byte = src[i * sizeof(f32) + plane];
+            dest[plane * sample_count + i] = byte - previous;
+            previous = byte;
+        }
+    }
+}
+
+// Reverse transpose_sample_block.
+static void untranspose_sample_block(u8 * src, u8 * dest, int sample_count)
+{
+    for (int plane = 0; plane < sizeof(f32); ++plane)
+    {
+        u8 previous = 0;
+        for (int i = 0; i < sample_count; ++i)
+        {
+            previous += src[plane * sample_count + i];
+            dest[i * sizeof(f32) + plane] = previous;
+        }
+    }
+}
+
+// Rearrange a buffer of samples into transposed blocks.
+// Any bytes after the last whole sample are copied as they are.
+void transpose_samples(void * src, void * dest, u64 byte_count)
+{
+    u64 sample_count = byte_count / sizeof(f32);
+    for (u64 i = 0; i < sample_count; i += SAMPLE_BLOCK_COUNT)
+    {
+        int block_count = min(SAMPLE_BLOCK_COUNT, sample_count - i);
+        transpose_sample_block((u8 *)src + i * sizeof(f32),
+            (u8 *)dest + i * sizeof(f32), block_count);
+    }
+    u64 tail = sample_count * sizeof(f32);
+    memcpy((u8 *)dest + tail, (u8 *)src + tail, byte_count - tail);
+}
+
+// Restore transposed samples, in place.
+void untranspose_samples(void * samples, u64 byte_count)
+{
+    u8 block[SAMPLE_BLOCK_COUNT * sizeof(f32)];
+    u64 sample_count = byte_count / sizeof(f32);
+    for (u64 i = 0; i < sample_count; i += SAMPLE_BLOCK_COUNT)
+    {
+        int block_count = min(SAMPLE_BLOCK_COUNT, sample_count - i);
+        u8 * block_samples = (u8 *)samples + i * sizeof(f32);
+        memcpy(block, block_samples, block_count * sizeof(f32));
+        untranspose_sample_block(block, block_samples, block_count);
+    }
+}
@@ -0,0 +1,639 @@
+//
+// cooker.c
+//
+// This file contains:
+//     - Program entry point for the asset cooker.
+//     - Asset manifest reading.
+//     - Animation frame trimming and de-duplication.
+//     - Mirrored animation detection.
+//     - Palette indexing.
+//     - Animation delta encoding.
+//     - Asset compression.
+//     - Cooked asset archive writing and size report.
+//
+// The cooker is a separate program. It reads the loose asset files listed in
+// the manifest and writes them into a single archive (see assets.c) that the
+// game maps at start-up. Each animation frame is trimmed to the bounds of its
+// visible pixels and identical frames are stored once, so there is less to
+// store, load and draw. An animation that is a mirror image of an earlier one
+// only stores its frame table, and is drawn flipped. Images and animations with
+// no more than 255 colours are stored as 8-bit indices into a palette, and
+// indexed animations are delta encoded when that is smaller. With
+// --compress, the data of each asset is also compressed, where that makes it
+// smaller.
+//
+
+// Compile time options for the memory allocator.
+#define POOL_STATIC_ALLOCATE
+#define POOL_STATIC_PERSIST_BYTE_COUNT (64 * 1000 * 1000)
+
+// External includes here:
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#include <SDL2/SDL.h>
+
+#include "common.c"
+#include "memory.c"
+#include "profile.c"
+#include "compress.c"
+#include "graphics.c"
+#include "audio.c"
+#include "assets.c"
+
+#define MAX_COOKED_ASSETS 256
+
+//
+// Frame trimming.
+//
+
+// Find the bounds of the visible pixels in a frame of an animation.
+// A frame with no visible pixels has a width and height of zero.
+Animation_Frame find_frame_bounds(u32 * frame_pixels, int width, int height)
+{
+    int min_x = width, min_y = height, max_x = -1, max_y = -1;
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            if (get_alpha(frame_pixels[x + y * width]))
+            {
+                min_x = min(min_x, x);
+                min_y = min(min_y, y);
+                max_x = max(max_x, x);
+                max_y = max(max_y, y);
+            }
+        }
+    }
+    if (max_x < 0) return (Animation_Frame){};
+    return (Animation_Frame)
+    {
+        .x = min_x,
+        .y = min_y,
+        .width = max_x - min_x + 1,
+        .height = max_y - min_y + 1,
+    };
+}
+
+// Trim each frame of an animation, storing each distinct frame once.
+// Fills in the item's data and frame table, and returns the number of distinct
+// frames.
+int cook_animation(Asset_Archive_Item * item, Image image,
+    int frame_width, int frame_height, int frame_count)
+{
+    u32 * cooked_pixels = pool_alloc(PERSIST_POOL, image.width * image.height * sizeof(u32));
+    Animation_Frame * frames = pool_alloc(PERSIST_POOL, frame_count * sizeof(Animation_Frame));
+    u32 pixel_count = 0;
+    int unique_frame_count = 0;
+
+    for (int frame_index = 0; frame_index < frame_count; ++frame_index)
+    {
+        u32 * frame_pixels = image.pixels + frame_index * frame_width * frame_height;
+        Animation_Frame frame = find_frame_bounds(frame_pixels, frame_width, frame_height);
+
+        // Copy the trimmed frame to the end of the cooked pixels.
+        frame.pixel_offset = pixel_count;
+        u32 * trimmed = cooked_pixels + pixel_count;
+        for (int y = 0; y < frame.height; ++y)
+        {
+            for (int x = 0; x < frame.width; ++x)
+            {
+                trimmed[x + y * frame.width] =
+                    frame_pixels[(frame.x + x) + (frame.y + y) * frame_width];
+            }
+        }
+
+        // Point at an earlier frame if it is identical.
+        u64 byte_count = frame.width * frame.height * sizeof(u32);
+        bool duplicate = false;
+        for (int i = 0; i < frame_index && !duplicate; ++i)
+        {
+            if (frames[i].width == frame.width && frames[i].height == frame.height &&
+                equal(cooked_pixels + frames[i].pixel_offset, trimmed, byte_count))
+            {
+                frame.pixel_offset = frames[i].pixel_offset;
+                duplicate = true;
+            }
+        }
+        if (!duplicate)
+        {
+            pixel_count += frame.width * frame.height;
+            ++unique_frame_count;
+        }
+        frames[frame_index] = frame;
+    }
+
+    item->entry.width = frame_width;
+    item->entry.height = frame_height;
+    item->entry.frame_count = frame_count;
+    item->entry.byte_count = pixel_count * sizeof(u32);
+    item->data = cooked_pixels;
+    item->frames = frames;
+    return unique_frame_count;
+}
+
+//
+// Mirror images.
+//
+
+// Returns true if a trimmed frame of b is the trimmed frame of a, flipped.
+static bool frames_are_flipped(u32 * a, u32 * b, int width, int height, int flip)
+{
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            int ax = (flip & FLIP_HORIZONTAL) ? width - 1 - x : x;
+            int ay = (flip & FLIP_VERTICAL) ? height - 1 - y : y;
+            if (a[ax + ay * width] != b[x + y * width]) return false;
+        }
+    }
+    return true;
+}
+
+// Returns true if every frame of animation b is the same frame of a, flipped.
+static bool animation_is_flipped(Asset_Archive_Item * a, Asset_Archive_Item * b, int flip)
+{
+    for (int i = 0; i < b->entry.frame_count; ++i)
+    {
+        Animation_Frame fa = a->frames[i];
+        Animation_Frame fb = b->frames[i];
+        if (fa.width != fb.width || fa.height != fb.height ||
+            !frames_are_flipped((u32 *)a->data + fa.pixel_offset,
+                (u32 *)b->data + fb.pixel_offset, fb.width, fb.height, flip))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Look for an earlier animation that a cooked animation is a mirror image of.
+// If there is one, the item is changed to share its pixels and be drawn
+// flipped. Each frame is placed so that it lands in the same spot once it is
+// flipped within the full frame.
+// Returns the index of the earlier item, or -1.
+int find_mirrored_animation(Asset_Archive_Item * items, int item_count,
+    Asset_Archive_Item * item)
+{
+    Asset_Archive_Entry * entry = &item->entry;
+    if (entry->kind != ASSET_ANIMATION) return -1;
+    for (int i = 0; i < item_count; ++i)
+    {
+        Asset_Archive_Item * source = &items[i];
+        if (source->entry.kind != ASSET_ANIMATION || source->source_index ||
+            source->entry.frame_count != entry->frame_count)
+        {
+            continue;
+        }
+        for (int flip = FLIP_HORIZONTAL; flip <= (FLIP_HORIZONTAL | FLIP_VERTICAL); ++flip)
+        {
+            if (!animation_is_flipped(source, item, flip)) continue;
+            for (int f = 0; f < entry->frame_count; ++f)
+            {
+                Animation_Frame * frame = &item->frames[f];
+                if (flip & FLIP_HORIZONTAL) frame->x = entry->width - frame->x - frame->width;
+                if (flip & FLIP_VERTICAL) frame->y = entry->height - frame->y - frame->height;
+                frame->pixel_offset = source->frames[f].pixel_offset;
+            }
+            item->data = NULL;
+            item->source_index = i + 1;
+            entry->flip = flip;
+            return i;
+        }
+    }
+    return -1;
+}
+
+//
+// Palette indexing.
+//
+
+// Convert the pixels of an image or animation to indices into a palette, if
+// there are few enough distinct colours. Transparent pixels become index zero.
+// Returns the number of colours used, or zero if the item was left as it is.
+int index_item(Asset_Archive_Item * item)
+{
+    Asset_Archive_Entry * entry = &item->entry;
+    if (entry->kind != ASSET_IMAGE && entry->kind != ASSET_ANIMATION) return 0;
+
+    u64 pixel_count = entry->byte_count / sizeof(u32);
+    u32 * src = item->data;
+    u8 * data = pool_alloc(PERSIST_POOL, PALETTE_BYTE_COUNT + pixel_count);
+    u32 * palette = (u32 *)data;
+    u8 * indices = data + PALETTE_BYTE_COUNT;
+    set_memory(palette, PALETTE_BYTE_COUNT, 0);
+    int colour_count = 1;
+    int last_index = 0;
+
+    for (u64 i = 0; i < pixel_count; ++i)
+    {
+        u32 p = src[i];
+        if (get_alpha(p) == 0)
+        {
+            indices[i] = 0;
+            continue;
+        }
+        // Neighbouring pixels are usually the same colour.
+        if (last_index == 0 || palette[last_index] != p)
+        {
+            last_index = 1;
+            while (last_index < colour_count && palette[last_index] != p) ++last_index;
+            if (last_index == colour_count)
+            {
+                if (colour_count == 256) return 0;
+                palette[colour_count++] = p;
+            }
+        }
+        indices[i] = last_index;
+    }
+
+    item->data = data;
+    entry->byte_count = PALETTE_BYTE_COUNT + pixel_count;
+    entry->decoded_byte_count = entry->byte_count;
+    entry->indexed = true;
+    return colour_count - 1;
+}
+
+//
+// Delta encoding.
+//
+
+// Spans closer together than this are merged, since each span costs more than
+// copying a few unchanged pixels.
+#define DELTA_SPAN_MERGE_GAP (sizeof(Delta_Span))
+
+// Find the spans of a frame that differ from the keyframe. If spans is not
+// NULL they are written to it, with their indices appended to span_indices.
+// Returns the number of spans.
+static int find_delta_spans(u8 * keyframe, u8 * frame, int width, int height,
+    Delta_Span * spans, u8 * span_indices, u32 * span_indices_count)
+{
+    int span_count = 0;
+    for (int y = 0; y < height; ++y)
+    {
+        u8 * key_row = keyframe + y * width;
+        u8 * row = frame + y * width;
+        int x = 0;
+        while (x < width)
+        {
+            if (key_row[x] == row[x])
+            {
+                ++x;
+                continue;
+            }
+            // Extend the span until there is a long enough run of unchanged pixels.
+            int start = x;
+            int end = x + 1;
+            for (int i = end; i < width && i - end < DELTA_SPAN_MERGE_GAP; ++i)
+            {
+                if (key_row[i] != row[i]) end = i + 1;
+            }
+            if (spans)
+            {
+                spans[span_count] = (Delta_Span)
+                {
+                    .x = start,
+                    .y = y,
+                    .length = end - start,
+                    .index_offset = *span_indices_count,
+                };
+                memcpy(span_indices + *span_indices_count, row + start, end - start);
+            }
+            *span_indices_count += end - start;
+            ++span_count;
+            x = end;
+        }
+    }
+    return span_count;
+}
+
+// Delta encode an indexed animation, if that makes it smaller. The frame that
+// differs least from the others is used as the keyframe.
+// Returns true if the item was encoded.
+bool delta_encode_item(Asset_Archive_Item * item)
+{
+    Asset_Archive_Entry * entry = &item->entry;
+    if (entry->kind != ASSET_ANIMATION || !entry->indexed) return false;
+
+    // Expand the trimmed frames back to full frames.
+    int width = entry->width, height = entry->height, frame_count = entry->frame_count;
+    u64 frame_byte_count = width * height;
+    u8 * indices = (u8 *)item->data + PALETTE_BYTE_COUNT;
+    u8 * full_frames = pool_alloc(PERSIST_POOL, frame_count * frame_byte_count);
+    set_memory(full_frames, frame_count * frame_byte_count, 0);
+    for (int i = 0; i < frame_count; ++i)
+    {
+        Animation_Frame f = item->frames[i];
+        for (int y = 0; y < f.height; ++y)
+        {
+            memcpy(full_frames + i * frame_byte_count + f.x + (f.y + y) * width,
+                indices + f.pixel_offset + y * f.width, f.width);
+        }
+    }
+
+    int keyframe = 0;
+    u64 best_byte_count = ~(u64)0;
+    u32 span_count = 0;
+    for (int k = 0; k < frame_count; ++k)
+    {
+        u32 k_span_count = 0, k_span_indices_count = 0;
+        for (int i = 0; i < frame_count; ++i)
+        {
+            k_span_count += find_delta_spans(full_frames + k * frame_byte_count,
+                full_frames + i * frame_byte_count, width, height,
+                NULL, NULL, &k_span_indices_count);
+        }
+        u64 byte_count = k_span_count * sizeof(Delta_Span) + k_span_indices_count;
+        if (byte_count < best_byte_count)
+        {
+            best_byte_count = byte_count;
+            keyframe = k;
+            span_count = k_span_count;
+        }
+    }
+
+    u64 byte_count = PALETTE_BYTE_COUNT + frame_count * sizeof(Delta_Frame) +
+        frame_byte_count + best_byte_count;
+    u64 trimmed_byte_count = entry->byte_count + frame_count * sizeof(Animation_Frame);
+    if (byte_count >= trimmed_byte_count) return false;
+
+    u8 * data = pool_alloc(PERSIST_POOL, byte_count);
+    memcpy(data, item->data, PALETTE_BYTE_COUNT);
+    Delta_Frame * frames = (Delta_Frame *)(data + PALETTE_BYTE_COUNT);
+    Delta_Span * spans = (Delta_Span *)(frames + frame_count);
+    u8 * keyframe_indices = (u8 *)(spans + span_count);
+    u8 * span_indices = keyframe_indices + frame_byte_count;
+    memcpy(keyframe_indices, full_frames + keyframe * frame_byte_count, frame_byte_count);
+    u32 first_span = 0, span_indices_count = 0;
+    for (int i = 0; i < frame_count; ++i)
+    {
+        frames[i].first_span = first_span;
+        frames[i].span_count = find_delta_spans(keyframe_indices,
+            full_frames + i * frame_byte_count, width, height,
+            spans + first_span, span_indices, &span_indices_count);
+        first_span += frames[i].span_count;
+    }
+
+    item->data = data;
+    item->frames = NULL;
+    entry->byte_count = byte_count;
+    entry->decoded_byte_count = byte_count;
+    entry->delta = true;
+    return true;
+}
+
+//
+// Compression.
+//
+
+// Compress the data of an item, if it is worth doing.
+void compress_item(Asset_Archive_Item * item)
+{
+    Asset_Archive_Entry * entry = &item->entry;
+    u64 byte_count = entry->byte_count;
+    u8 * src = item->data;
+    if (entry->kind == ASSET_SOUND)
+    {
+        src = pool_alloc(PERSIST_POOL, byte_count);
+        transpose_samples(item->data, src, byte_count);
+    }
+    u8 * compressed = pool_alloc(PERSIST_POOL, lz_compress_bound(byte_count));
+    u64 compressed_byte_count = lz_compress(src, byte_count, compressed);
+
+    // Check that it comes back the same.
+    u8 * decoded = pool_alloc(PERSIST_POOL, byte_count);
+    if (!lz_decompress(compressed, compressed_byte_count, decoded, byte_count))
+    {
+        panic_exit("Could not decompress %s.", entry->name);
+    }
+    if (entry->kind == ASSET_SOUND) untranspose_samples(decoded, byte_count);
+    if (!equal(decoded, item->data, byte_count))
+    {
+        panic_exit("Compressed %s does not match the original.", entry->name);
+    }
+
+    if (compressed_byte_count < byte_count)
+    {
+        entry->encoding = entry->kind == ASSET_SOUND ?
+            ASSET_ENCODING_TRANSPOSED_LZ : ASSET_ENCODING_LZ;
+        entry->byte_count = compressed_byte_count;
+        item->data = compressed;
+    }
+}
+
+//
+// Cooking.
+//
+
+// Returns the size of a file in bytes, or zero if it cannot be opened.
+u64 file_byte_count(char * file_name)
+{
+    FILE * file = fopen(file_name, "rb");
+    if (!file) return 0;
+    fseek(file, 0, SEEK_END);
+    u64 byte_count = ftell(file);
+    fclose(file);
+    return byte_count;
+}
+
+// Load an asset listed in the manifest into an archive item.
+// Returns false if the asset could not be loaded.
+bool cook_asset(Asset_Archive_Item * item, char * assets_dir, Asset * asset)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s%s", assets_dir, asset->file_name);
+    Asset_Archive_Entry * entry = &item->entry;
+    copy_memory(asset->name, entry->name, ASSET_NAME_MAX);
+    copy_memory(asset->file_name, entry->file_name, ASSET_NAME_MAX);
+    entry->kind = asset->kind;
+    entry->group = asset->group;
+    entry->frame_duration_ms = asset->frame_duration_ms;
+
+    if (asset->kind == ASSET_SOUND)
+    {
+        Sound sound = read_raw_sound(PERSIST_POOL, path);
+        if (!sound.samples) return false;
+        entry->width = sound.sample_count;
+        entry->byte_count = sound.sample_count * sizeof(f32);
+        entry->decoded_byte_count = entry->byte_count;
+        item->data = sound.samples;
+        return true;
+    }
+
+    Image image = read_image_file(PERSIST_POOL, path);
+    if (!image.pixels) return false;
+    item->data = image.pixels;
+    entry->byte_count = image.width * image.height * sizeof(u32);
+
+    if (asset->kind == ASSET_ANIMATION)
+    {
+        int frame_count = max(asset->frame_count, 1);
+        int unique_frame_count = cook_animation(item, image,
+            asset->width ? asset->width : image.width,
+            asset->height ? asset->height : image.height / frame_count,
+            frame_count);
+        printf("    %-22s %d of %d frames distinct\n",
+            asset->name, unique_frame_count, frame_count);
+    }
+    else if (asset->kind == ASSET_FONT)
+    {
+        entry->width = asset->width;
+        entry->height = asset->height;
+    }
+    else
+    {
+        entry->width = image.width;
+        entry->height = image.height;
+    }
+    entry->decoded_byte_count = entry->byte_count;
+    return true;
+}
+
+//
+// Program entry point.
+//
+// Usage: cooker [--compress] [assets directory] [output archive]
+//
+
+int main(int argument_count, char ** arguments)
+{
+    setbuf(stdout, 0);
+
+    bool compress = argument_count > 1 && strcmp(arguments[1], "--compress") == 0;
+    if (compress)
+    {
+        --argument_count;
+        ++arguments;
+    }
+
+    char * assets_dir = argument_count > 1 ? arguments[1] : "../assets/";
+    char * output_file_name = argument_count > 2 ?
+        arguments[2] : "../assets/" ASSET_ARCHIVE_FILE_NAME;
+
+    if (!init_memory_pools(megabytes(64), megabytes(1), megabytes(1)))
+    {
+        panic_exit("Could not initialise memory pools.");
+    }
+
+    // Registering each asset catches names that are used twice (or that have
+    // the same hash), which the game would refuse to load.
+    if (!init_asset_registry(PERSIST_POOL))
+    {
+        panic_exit("Could not allocate the asset registry.");
+    }
+
+    char manifest_path[512];
+    snprintf(manifest_path, sizeof(manifest_path), "%s%s",
+        assets_dir, MANIFEST_FILE_NAME);
+    FILE * manifest = fopen(manifest_path, "r");
+    if (!manifest)
+    {
+        panic_exit("Could not open %s.\n%s", manifest_path, strerror(errno));
+    }
+
+    Asset_Archive_Item * items = pool_alloc(PERSIST_POOL,
+        MAX_COOKED_ASSETS * sizeof(Asset_Archive_Item));
+    u64 * original_byte_counts = pool_alloc(PERSIST_POOL,
+        MAX_COOKED_ASSETS * sizeof(u64));
+    bool * is_mirror_source = pool_alloc(PERSIST_POOL, MAX_COOKED_ASSETS * sizeof(bool));
+    set_memory(is_mirror_source, MAX_COOKED_ASSETS * sizeof(bool), 0);
+    int item_count = 0;
+
+    printf("Cooking assets from %s\n", assets_dir);
+    char line[256];
+    while (fgets(line, sizeof(line), manifest))
+    {
+        Asset asset;
+        if (!parse_manifest_line(line, &asset)) continue;
+        if (item_count == MAX_COOKED_ASSETS)
+        {
+            panic_exit("Too many assets in the manifest.");
+        }
+        if (!register_asset(&asset))
+        {
+            panic_exit("The asset name %s is already in use.", asset.name);
+        }
+
+        Asset_Archive_Item * item = &items[item_count];
+        *item = (Asset_Archive_Item){};
+        if (!cook_asset(item, assets_dir, &asset))
+        {
+            panic_exit("Could not cook %s.\n%s", asset.file_name, strerror(errno));
+        }
+        int source_index = find_mirrored_animation(items, item_count, item);
+        if (source_index >= 0)
+        {
+            is_mirror_source[source_index] = true;
+            printf("    %-22s mirror image of %s\n",
+                asset.name, items[source_index].entry.name);
+        }
+        char path[512];
+        snprintf(path, sizeof(path), "%s%s", assets_dir, asset.file_name);
+        original_byte_counts[item_count] = file_byte_count(path);
+        ++item_count;
+    }
+    fclose(manifest);
+
+    // Index and compress once every item is cooked, since finding mirror images
+    // needs the original pixels.
+    for (int i = 0; i < item_count; ++i)
+    {
+        if (items[i].source_index) continue;
+        int colour_count = index_item(&items[i]);
+        if (colour_count)
+        {
+            printf("    %-22s indexed, %d colours\n", items[i].entry.name, colour_count);
+        }
+        // The frames of an animation that others mirror have to stay trimmed.
+        if (!is_mirror_source[i] && delta_encode_item(&items[i]))
+        {
+            printf("    %-22s delta encoded\n", items[i].entry.name);
+        }
+        if (compress) compress_item(&items[i]);
+    }
+
+    if (!write_asset_archive(output_file_name, items, item_count))
+    {
+        panic_exit("Could not write %s.\n%s", output_file_name, strerror(errno));
+    }
+
+    //
+    // Report the size of each asset before and after cooking.
+    //
+
+    printf("\n%-22s %10s %10s %7s\n", "Asset", "Original", "Cooked", "Saved");
+    u64 total_original = 0, total_cooked = 0;
+    for (int i = 0; i < item_count; ++i)
+    {
+        Asset_Archive_Entry * entry = &items[i].entry;
+        u64 cooked = items[i].source_index ? 0 : entry->byte_count;
+        if (items[i].frames) cooked += entry->frame_count * sizeof(Animation_Frame);
+        u64 original = original_byte_counts[i];
+        printf("%-22s %10llu %10llu %6.1f%%\n", entry->name,
+            (unsigned long long)original, (unsigned long long)cooked, 100.0 - cooked / (f64)original * 100.0);
+        total_original += original;
+        total_cooked += cooked;
+    }
+    printf("%-22s %10llu %10llu %6.1f%%\n", "Total",
+        (unsigned long long)total_original, (unsigned long long)total_cooked,
+        100.0 - total_cooked / (f64)total_original * 100.0);
+    printf("Wrote %s (%llu bytes)\n", output_file_name,
+        (unsigned long long)file_byte_count(output_file_name));
+
+    return 0;
+}
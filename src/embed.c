@@ -0,0 +1,39 @@
+//
+// embed.c
+//
+// This file contains:
+//     - The cooked asset archive, embedded as read-only data.
+//
+// This file is compiled on its own into an object file, which is linked into
+// the game when it is built with EMBED_ASSETS defined (see build.sh). The
+// archive must be cooked first, and it should be cooked without compression,
+// so that the assets can point straight at the embedded data. Like any other
+// read-only data in the executable, its pages are only loaded when touched.
+//
+
+#ifdef __APPLE__
+#define EMBED_SECTION ".const_data"
+#define EMBED_SYMBOL(name) "_" #name
+#elif defined(_WIN32)
+#define EMBED_SECTION ".rdata,\"dr\""
+#define EMBED_SYMBOL(name) #name
+#else
+#define EMBED_SECTION ".rodata"
+#define EMBED_SYMBOL(name) #name
+#endif
+
+#ifndef EMBED_ASSET_ARCHIVE_PATH
+#define EMBED_ASSET_ARCHIVE_PATH "../assets/assets.pack"
+#endif
+
+// The archive is page aligned, as it would be if it were mapped from a file.
+__asm__(
+    ".section " EMBED_SECTION "\n"
+    ".balign 4096\n"
+    ".globl " EMBED_SYMBOL(embedded_asset_archive) "\n"
+    EMBED_SYMBOL(embedded_asset_archive) ":\n"
+    ".incbin \"" EMBED_ASSET_ARCHIVE_PATH "\"\n"
+    ".globl " EMBED_SYMBOL(embedded_asset_archive_end) "\n"
+    EMBED_SYMBOL(embedded_asset_archive_end) ":\n"
+    ".previous\n"
+);
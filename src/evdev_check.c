@@ -0,0 +1,183 @@
+//
+// evdev_check.c
+//
+// This file contains:
+//     - Program entry point for the evdev input check.
+//     - Virtual keyboard.
+//
+// The evdev check is a separate program, for Linux only. It creates a virtual
+// keyboard with uinput, starts the evdev input backend (see input.c) and
+// presses the two shift keys in turn. Each press and release must come out of
+// the input queue in order, for the right player, with a time stamp from
+// between when it was sent and when it came out. How long each took to come
+// out after its time stamp is reported. Creating the keyboard needs permission
+// to write /dev/uinput, and reading it needs permission to read /dev/input, so
+// the check is usually run as root.
+//
+// Options:
+//     --presses sets how many presses are sent (100 by default).
+//     --interval sets the time between presses in milliseconds (20 by default).
+//
+
+// External includes here:
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <linux/uinput.h>
+#include <SDL2/SDL.h>
+
+#include "common.c"
+#include "profile.c"
+#include "input.c"
+
+#define EVDEV_CHECK_DEFAULT_PRESSES 100
+#define EVDEV_CHECK_DEFAULT_INTERVAL_MS 20
+// How long an event may take to come out of the queue before giving up.
+#define EVDEV_CHECK_TIMEOUT_US 1000000
+
+//
+// Virtual keyboard.
+//
+
+// Create a keyboard with just the two shift keys.
+// Returns the uinput file, or -1 if the keyboard could not be created.
+int create_virtual_keyboard()
+{
+    int file = open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (file < 0) return -1;
+    struct uinput_setup setup =
+    {
+        .id = { .bustype = BUS_VIRTUAL, .vendor = 0x1, .product = 0x1 },
+        .name = "rhythm evdev check",
+    };
+    if (ioctl(file, UI_SET_EVBIT, EV_KEY) < 0 ||
+        ioctl(file, UI_SET_KEYBIT, KEY_LEFTSHIFT) < 0 ||
+        ioctl(file, UI_SET_KEYBIT, KEY_RIGHTSHIFT) < 0 ||
+        ioctl(file, UI_DEV_SETUP, &setup) < 0 ||
+        ioctl(file, UI_DEV_CREATE) < 0)
+    {
+        close(file);
+        return -1;
+    }
+    return file;
+}
+
+// Press or release a key, and send the report that ends the event.
+// Returns false if the events could not be written.
+bool send_virtual_key(int file, int code, bool pressed)
+{
+    struct input_event events[2] =
+    {
+        { .type = EV_KEY, .code = code, .value = pressed },
+        { .type = EV_SYN, .code = SYN_REPORT },
+    };
+    return write(file, events, sizeof(events)) == sizeof(events);
+}
+
+//
+// Program entry point.
+//
+
+int main(int argument_count, char ** arguments)
+{
+    setbuf(stdout, 0);
+
+    int press_count = EVDEV_CHECK_DEFAULT_PRESSES;
+    int interval_ms = EVDEV_CHECK_DEFAULT_INTERVAL_MS;
+    for (int i = 1; i < argument_count; ++i)
+    {
+        if (strcmp(arguments[i], "--presses") == 0 && i + 1 < argument_count)
+        {
+            press_count = atoi(arguments[++i]);
+        }
+        else if (strcmp(arguments[i], "--interval") == 0 && i + 1 < argument_count)
+        {
+            interval_ms = atoi(arguments[++i]);
+        }
+    }
+
+    int keyboard = create_virtual_keyboard();
+    if (keyboard < 0)
+    {
+        panic_exit("Could not create a virtual keyboard with uinput.\n%s",
+            strerror(errno));
+    }
+    // Give the device node a moment to appear.
+    SDL_Delay(200);
+    if (!start_evdev_input())
+    {
+        panic_exit("Could not read the virtual keyboard with evdev.\n%s",
+            strerror(errno));
+    }
+
+    int event_count = 0;
+    u64 total_delay_us = 0;
+    u64 max_delay_us = 0;
+    bool passed = true;
+    for (int press = 0; press < press_count && passed; ++press)
+    {
+        int player = press & 1;
+        int code = player ? KEY_RIGHTSHIFT : KEY_LEFTSHIFT;
+        for (int pressed = 1; pressed >= 0 && passed; --pressed)
+        {
+            u64 sent_us = get_time_us();
+            if (!send_virtual_key(keyboard, code, pressed))
+            {
+                panic_exit("Could not write to the virtual keyboard.\n%s",
+                    strerror(errno));
+            }
+
+            Input_Event event;
+            bool received = false;
+            u64 received_us;
+            do
+            {
+                received = next_input_event(&event);
+                received_us = get_time_us();
+            }
+            while (!received && received_us - sent_us < EVDEV_CHECK_TIMEOUT_US);
+
+            if (!received)
+            {
+                printf("Press %d: nothing was received.\n", press);
+                passed = false;
+            }
+            else if (event.player != player || event.pressed != pressed)
+            {
+                printf("Press %d: expected player %d %s, but got player %d %s.\n",
+                    press, player, pressed ? "pressed" : "released",
+                    event.player, event.pressed ? "pressed" : "released");
+                passed = false;
+            }
+            else if (event.time_stamp_us < sent_us || event.time_stamp_us > received_us)
+            {
+                printf("Press %d: the time stamp is %lld us after it was sent, "
+                    "and %lld us before it was received.\n", press,
+                    (long long)(event.time_stamp_us - sent_us),
+                    (long long)(received_us - event.time_stamp_us));
+                passed = false;
+            }
+            else
+            {
+                u64 delay_us = received_us - event.time_stamp_us;
+                total_delay_us += delay_us;
+                max_delay_us = max(max_delay_us, delay_us);
+                ++event_count;
+            }
+            sleep_until_ns(get_time_ns() + interval_ms * 1000000ull / 2);
+        }
+    }
+
+    ioctl(keyboard, UI_DEV_DESTROY);
+    close(keyboard);
+
+    printf("Received %d events, %.1f us after their time stamps on average "
+        "(%llu us at most).\n", event_count,
+        (f64)total_delay_us / max(event_count, 1), (unsigned long long)max_delay_us);
+    printf(passed ? "The evdev backend works.\n" : "The evdev backend does not work!\n");
+    return passed ? 0 : 1;
+}
@@ -3,10 +3,12 @@
 //
 // This file contains:
 //     - Pixel manipulation utilities.
+//     - Background occlusion.
 //     - Graphical primitive rendering.
 //     - Bitmap rendering.
 //     - Animated bitmap handling and rendering.
 //     - Bitmap font rendering.
+//     - Cached overlays.
 //
 
 // The fixed resolution of the internal pixel buffer.
@@ -28,29 +30,120 @@ static inline u32 get_blue(u32 colour)  { return (colour & 0x00ff0000) >> 16; }
 static inline u32 get_green(u32 colour) { return (colour & 0x0000ff00) >> 8; }
 static inline u32 get_alpha(u32 colour) { return (colour & 0x000000ff) >> 0; }
 
-// Set every pixel of the internal buffer to a colour.
+//
+// Background occlusion.
+//
+// Backgrounds (clear and draw_noise) cover the whole screen, and are then
+// mostly drawn over by sprites in the same frame. To avoid that, the spans of
+// the screen that will be covered by opaque pixels can be marked as occluded
+// before the background is drawn, and the background skips them. Each row
+// holds a few occluded spans, and any more than that are ignored, which only
+// means more is drawn. The occluded spans only apply to the next background
+// that is drawn, and are then reset.
+//
+
+#define MAX_ROW_OCCLUDERS 4
+
+typedef struct
+{
+    s16 start;
+    s16 end;    // One past the last pixel.
+}
+Coverage_Span;
+
+struct
+{
+    Coverage_Span spans[HEIGHT][MAX_ROW_OCCLUDERS];
+    u8 span_counts[HEIGHT];
+    bool any;
+}
+occlusion;
+
+// Mark part of a row of the screen as covered by whatever is drawn next.
+void occlude_span(int y, int start, int end)
+{
+    start = max(start, 0);
+    end = min(end, WIDTH);
+    if (y < 0 || y >= HEIGHT || start >= end) return;
+    int count = occlusion.span_counts[y];
+    if (count == MAX_ROW_OCCLUDERS) return;
+    // Keep the spans of each row in order.
+    int i = count;
+    while (i > 0 && occlusion.spans[y][i - 1].start > start)
+    {
+        occlusion.spans[y][i] = occlusion.spans[y][i - 1];
+        --i;
+    }
+    occlusion.spans[y][i] = (Coverage_Span){ start, end };
+    occlusion.span_counts[y] = count + 1;
+    occlusion.any = true;
+}
+
+// Returns the next unoccluded run of a row at or after x, as [x, *end).
+// Returns false if there are none.
+static inline bool next_unoccluded_run(int y, int * x, int * end)
+{
+    int run_start = *x;
+    int run_end = WIDTH;
+    for (int i = 0; i < occlusion.span_counts[y]; ++i)
+    {
+        Coverage_Span span = occlusion.spans[y][i];
+        if (span.end <= run_start) continue;
+        if (span.start <= run_start)
+        {
+            run_start = span.end;
+            continue;
+        }
+        run_end = span.start;
+        break;
+    }
+    *x = run_start;
+    *end = run_end;
+    return run_start < WIDTH;
+}
+
+static inline void reset_occlusion()
+{
+    if (!occlusion.any) return;
+    set_memory(occlusion.span_counts, sizeof(occlusion.span_counts), 0);
+    occlusion.any = false;
+}
+
+// Set every pixel of the internal buffer to a colour, except any occluded ones.
 void clear(u32 colour)
 {
+    PROFILE_ZONE("clear");
     for (int y = 0; y < HEIGHT; ++y)
     {
-        for (int x = 0; x < WIDTH; ++x)
+        int x = 0, end;
+        while (next_unoccluded_run(y, &x, &end))
         {
-            pixels[x + y * WIDTH] = colour;
+            for (; x < end; ++x)
+            {
+                pixels[x + y * WIDTH] = colour;
+            }
         }
     }
+    reset_occlusion();
 }
 
-// Draws noise over the entire screen.
+// Draws noise over the entire screen, except any occluded pixels.
 void draw_noise(float intensity)
 {
+    PROFILE_ZONE("draw_noise");
     for (int y = 0; y < HEIGHT; ++y)
     {
-        for (int x = 0; x < WIDTH; ++x)
+        int x = 0, end;
+        while (next_unoccluded_run(y, &x, &end))
         {
-            int r = random_int_range(0, intensity * 255);
-            pixels[x + y * WIDTH] = rgba(r, r, r, 255);
+            for (; x < end; ++x)
+            {
+                int r = random_int_range(0, intensity * 255);
+                pixels[x + y * WIDTH] = rgba(r, r, r, 255);
+            }
         }
     }
+    reset_occlusion();
 }
 
 // Returns false if the given coordinates are off screen.
@@ -67,6 +160,7 @@ static inline bool set_pixel(int x, int y, u32 colour)
 // Draw a line using Bresenham's line algorithm.
 void draw_line(int ax, int ay, int bx, int by, u32 colour)
 {
+    PROFILE_ZONE("draw_line");
     int delta_x = abs(bx - ax);
     int delta_y = abs(by - ay);
     int step_x  = ax < bx ? 1 : -1;
@@ -87,33 +181,243 @@ void draw_line(int ax, int ay, int bx, int by, u32 colour)
 //
 // An Image is just a rectangular chunk of pixels with a width and height.
 //
+// An image can instead be indexed, with one byte per pixel that picks a colour
+// from a palette of 256. Index zero is always transparent. Indexed images use a
+// quarter of the memory, and can be drawn with a different palette to change
+// their colours without touching the pixels.
+//
 
 typedef struct
 {
     u32 * pixels;
     int width;
     int height;
+    u8 * indices;   // Used instead of pixels if there is a palette.
+    u32 * palette;
 }
 Image;
 
-// Draw a bitmap image to the internal buffer.
-void draw_image(Image image, int x, int y)
+static inline u8 blend_channel(u32 from, u32 to, f32 amount)
+{
+    return from + ((f32)to - (f32)from) * amount;
+}
+
+// Fill dest with a palette that is source blended towards a colour by amount
+// (from 0 to 1). Index zero stays transparent.
+void tint_palette(u32 * source, u32 * dest, u32 colour, f32 amount)
+{
+    dest[0] = 0;
+    for (int i = 1; i < 256; ++i)
+    {
+        u32 p = source[i];
+        dest[i] = rgba(
+            blend_channel(get_red(p),   get_red(colour),   amount),
+            blend_channel(get_blue(p),  get_blue(colour),  amount),
+            blend_channel(get_green(p), get_green(colour), amount),
+            get_alpha(p));
+    }
+}
+
+//
+// Flipping.
+//
+// Images can be drawn mirrored horizontally, vertically or both, so one set of
+// pixels can serve both sides of a symmetric sprite. Rows are copied by a pair
+// of kernels, one reading forwards and one backwards, which skip transparent
+// pixels. With SSE2 they do four pixels at a time, reversing the order of the
+// four with a shuffle when flipped.
+//
+
+typedef enum
+{
+    FLIP_NONE       = 0,
+    FLIP_HORIZONTAL = 1,
+    FLIP_VERTICAL   = 2,
+}
+Flip;
+
+#ifdef __SSE2__
+// Write four pixels, keeping the pixels already there where the mask is set.
+static inline void blit_four_pixels_masked(u32 * dest, __m128i source,
+    __m128i transparent)
+{
+    __m128i background = _mm_loadu_si128((__m128i *)dest);
+    __m128i blended = _mm_or_si128(_mm_and_si128(transparent, background),
+        _mm_andnot_si128(transparent, source));
+    _mm_storeu_si128((__m128i *)dest, blended);
+}
+
+// Write four pixels, keeping the pixels already there where they are transparent.
+static inline void blit_four_pixels(u32 * dest, __m128i source)
 {
-    int max_x = min(x + image.width, WIDTH);
-    int max_y = min(y + image.height, HEIGHT);
-    for (int sy = y, iy = 0; sy < max_y; ++sy, ++iy)
+    __m128i alpha = _mm_and_si128(source, _mm_set1_epi32(0xff));
+    blit_four_pixels_masked(dest, source,
+        _mm_cmpeq_epi32(alpha, _mm_setzero_si128()));
+}
+
+// Write the palette colours of four indices, packed into a u32 with the first
+// in the low byte, skipping index zero. SSE2 has no gather, so the colours are
+// fetched one at a time, but there is no branch on each index.
+static inline void blit_four_indices(u32 * dest, u32 four_indices, u32 * palette)
+{
+    if (!four_indices) return;
+    __m128i colours = _mm_setr_epi32(
+        palette[four_indices & 0xff], palette[(four_indices >> 8) & 0xff],
+        palette[(four_indices >> 16) & 0xff], palette[four_indices >> 24]);
+    __m128i zero = _mm_setzero_si128();
+    __m128i indices = _mm_unpacklo_epi16(
+        _mm_unpacklo_epi8(_mm_cvtsi32_si128(four_indices), zero), zero);
+    blit_four_pixels_masked(dest, colours, _mm_cmpeq_epi32(indices, zero));
+}
+#endif
+
+// Copy a row of count pixels, skipping transparent ones.
+static inline void blit_row(u32 * dest, u32 * src, int count)
+{
+    int i = 0;
+#ifdef __SSE2__
+    for (; i + 4 <= count; i += 4)
     {
-        for (int sx = x, ix = 0; sx < max_x; ++sx, ++ix)
+        blit_four_pixels(dest + i, _mm_loadu_si128((__m128i *)(src + i)));
+    }
+#endif
+    for (; i < count; ++i)
+    {
+        if (get_alpha(src[i]) != 0) dest[i] = src[i];
+    }
+}
+
+// Same as above, but reading backwards from the last pixel of the row.
+static inline void blit_row_reversed(u32 * dest, u32 * src_last, int count)
+{
+    int i = 0;
+#ifdef __SSE2__
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i source = _mm_loadu_si128((__m128i *)(src_last - i - 3));
+        blit_four_pixels(dest + i, _mm_shuffle_epi32(source, _MM_SHUFFLE(0, 1, 2, 3)));
+    }
+#endif
+    for (; i < count; ++i)
+    {
+        u32 p = src_last[-i];
+        if (get_alpha(p) != 0) dest[i] = p;
+    }
+}
+
+#ifdef __AVX2__
+// Write the palette colours of eight indices, skipping index zero.
+static inline void blit_eight_indices(u32 * dest, __m256i indices, u32 * palette)
+{
+    __m256i colours = _mm256_i32gather_epi32((int *)palette, indices, sizeof(u32));
+    __m256i opaque = _mm256_cmpgt_epi32(indices, _mm256_setzero_si256());
+    _mm256_maskstore_epi32((int *)dest, opaque, colours);
+}
+#endif
+
+// Expand a row of count indices through a palette, skipping transparent ones.
+// With AVX2 the colours of eight indices are fetched by one gather, otherwise
+// four at a time are written with SSE2.
+static inline void blit_indexed_row(u32 * dest, u8 * src, u32 * palette, int count)
+{
+    int i = 0;
+#ifdef __AVX2__
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i indices = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)(src + i)));
+        blit_eight_indices(dest + i, indices, palette);
+    }
+#endif
+#ifdef __SSE2__
+    for (; i + 4 <= count; i += 4)
+    {
+        u32 four_indices;
+        memcpy(&four_indices, src + i, sizeof(four_indices));
+        blit_four_indices(dest + i, four_indices, palette);
+    }
+#endif
+    for (; i < count; ++i)
+    {
+        if (src[i]) dest[i] = palette[src[i]];
+    }
+}
+
+// Same as above, but reading backwards from the last index of the row.
+static inline void blit_indexed_row_reversed(u32 * dest, u8 * src_last,
+    u32 * palette, int count)
+{
+    int i = 0;
+#ifdef __AVX2__
+    __m256i reverse = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i indices = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)(src_last - i - 7)));
+        blit_eight_indices(dest + i, _mm256_permutevar8x32_epi32(indices, reverse), palette);
+    }
+#endif
+#ifdef __SSE2__
+    for (; i + 4 <= count; i += 4)
+    {
+        u32 four_indices;
+        memcpy(&four_indices, src_last - i - 3, sizeof(four_indices));
+        blit_four_indices(dest + i, __builtin_bswap32(four_indices), palette);
+    }
+#endif
+    for (; i < count; ++i)
+    {
+        u8 index = src_last[-i];
+        if (index) dest[i] = palette[index];
+    }
+}
+
+// Draw a bitmap image to the internal buffer, mirrored by the given flags.
+void draw_image_flipped(Image image, int x, int y, int flip)
+{
+    // Clip the image to the edges of the screen.
+    int min_ix = max(0, -x);
+    int min_iy = max(0, -y);
+    int max_ix = min(image.width, WIDTH - x);
+    int max_iy = min(image.height, HEIGHT - y);
+    int count = max_ix - min_ix;
+    if (count <= 0) return;
+
+    PROFILE_ZONE("draw_image");
+    for (int iy = min_iy; iy < max_iy; ++iy)
+    {
+        int row = (flip & FLIP_VERTICAL) ? image.height - 1 - iy : iy;
+        u32 * dest = pixels + (x + min_ix) + (y + iy) * WIDTH;
+        if (image.palette)
         {
-            u32 p = image.pixels[ix + iy * image.width];
-            if (get_alpha(p) != 0)
+            u8 * src = image.indices + row * image.width;
+            if (flip & FLIP_HORIZONTAL)
+            {
+                blit_indexed_row_reversed(dest, src + image.width - 1 - min_ix,
+                    image.palette, count);
+            }
+            else
             {
-                set_pixel(sx, sy, p);
+                blit_indexed_row(dest, src + min_ix, image.palette, count);
             }
+            continue;
+        }
+        u32 * src = image.pixels + row * image.width;
+        if (flip & FLIP_HORIZONTAL)
+        {
+            blit_row_reversed(dest, src + image.width - 1 - min_ix, count);
+        }
+        else
+        {
+            blit_row(dest, src + min_ix, count);
         }
     }
 }
 
+// Draw a bitmap image to the internal buffer.
+void draw_image(Image image, int x, int y)
+{
+    draw_image_flipped(image, x, y, FLIP_NONE);
+}
+
 //
 // Animated Images.
 //
@@ -122,6 +426,64 @@ void draw_image(Image image, int x, int y)
 // to determine which frame should be displayed, or individual frames can be
 // displayed manually. By default, animations loop.
 //
+// Cooked animations (see cooker.c) also have a table of frames. Each frame is
+// trimmed to the bounds of its visible pixels, so it has its own size and
+// offset within the full frame, and identical frames share their pixels.
+//
+// An animation can be flipped, in which case every frame is mirrored within
+// the full frame. The cooker uses this to store an animation that is a mirror
+// image of another as just a frame table pointing at the other's pixels.
+//
+// Each frame of a loaded animation also has a coverage span for every row: the
+// longest run of opaque pixels in it. These are used to occlude the background
+// behind the frame (see occlude_animated_image_frame).
+//
+// Indexed animations can instead be delta encoded: one full keyframe, and for
+// every frame the spans of pixels in each row that differ from it. Any frame
+// can be decoded by copying the keyframe and then the frame's spans. Frames
+// are decoded into a buffer that holds the last one drawn, so moving to
+// another frame only has to put back the spans of the old frame and copy in
+// those of the new one, which is cheap when little changes between frames.
+//
+
+typedef struct
+{
+    s16 x;              // Offset of the trimmed frame within the full frame.
+    s16 y;
+    s16 width;          // Size of the trimmed frame.
+    s16 height;
+    u32 pixel_offset;   // Index of the frame's first pixel.
+}
+Animation_Frame;
+
+// A run of pixels in a row of a frame that differs from the keyframe.
+typedef struct
+{
+    u16 x;
+    u16 y;
+    u16 length;
+    u16 reserved;
+    u32 index_offset;   // Index of the span's first pixel in the span indices.
+}
+Delta_Span;
+
+typedef struct
+{
+    u32 first_span;
+    u32 span_count;
+}
+Delta_Frame;
+
+typedef struct
+{
+    Delta_Frame * frames;
+    Delta_Span * spans;
+    u8 * keyframe;          // Indices of every pixel of the keyframe.
+    u8 * span_indices;      // Indices of the pixels of every span.
+    u8 * decoded;           // Indices of every pixel of the decoded frame.
+    int decoded_frame;      // -1 if no frame has been decoded yet.
+}
+Delta_Animation;
 
 typedef struct
 {
@@ -131,85 +493,229 @@ typedef struct
     int frame_count;
     int frame_duration_ms;
     int start_time_ms;
+    Animation_Frame * frames;   // NULL if every frame is full size.
+    int flip;
+    u8 * indices;               // Used instead of pixels if there is a palette.
+    u32 * palette;
+    Delta_Animation * delta;    // NULL unless the frames are delta encoded.
+    Coverage_Span * coverage;   // height spans per frame, or NULL.
 }
 Animated_Image;
 
-// Draw an animated image to the internal buffer. This function expects that
-// the object passed in has appropriate numbers in each of its fields.
-void draw_animated_image(Animated_Image animated_image, int x, int y)
+// Copy the pixels of a frame's spans from src to dest, which are both full
+// frames. Copying from the span indices decodes the frame, and copying from
+// the keyframe reverts it.
+static void copy_delta_spans(Delta_Animation * delta, int frame, int width,
+    u8 * dest, u8 * src, bool from_span_indices)
 {
-    int time_passed = SDL_GetTicks() - animated_image.start_time_ms;
-    if (animated_image.frame_duration_ms == 0) return;
-    int frames_passed = time_passed / animated_image.frame_duration_ms;
-    int current_frame = frames_passed % animated_image.frame_count;
+    Delta_Frame f = delta->frames[frame];
+    for (u32 i = f.first_span; i < f.first_span + f.span_count; ++i)
+    {
+        Delta_Span span = delta->spans[i];
+        u32 offset = span.x + span.y * width;
+        memcpy(dest + offset,
+            from_span_indices ? src + span.index_offset : src + offset, span.length);
+    }
+}
+
+// Returns the indices of a frame of a delta encoded animation, decoding it
+// from the last frame that was decoded, or from the keyframe.
+u8 * decode_delta_frame(Delta_Animation * delta, int width, int height, int frame)
+{
+    if (delta->decoded_frame == frame) return delta->decoded;
+    if (delta->decoded_frame < 0)
+    {
+        memcpy(delta->decoded, delta->keyframe, width * height);
+    }
+    else
+    {
+        copy_delta_spans(delta, delta->decoded_frame, width,
+            delta->decoded, delta->keyframe, false);
+    }
+    copy_delta_spans(delta, frame, width, delta->decoded, delta->span_indices, true);
+    delta->decoded_frame = frame;
+    return delta->decoded;
+}
+
+
+// Returns a frame of an animation as an image, and its offset within the full
+// frame (before any flip).
+Image get_animation_frame(Animated_Image animated_image, int animation_frame,
+    int * offset_x, int * offset_y)
+{
+    *offset_x = 0;
+    *offset_y = 0;
+    if (animated_image.delta)
+    {
+        return (Image)
+        {
+            .width   = animated_image.width,
+            .height  = animated_image.height,
+            .indices = decode_delta_frame(animated_image.delta,
+                animated_image.width, animated_image.height, animation_frame),
+            .palette = animated_image.palette,
+        };
+    }
+    if (animated_image.frames)
+    {
+        Animation_Frame f = animated_image.frames[animation_frame];
+        *offset_x = f.x;
+        *offset_y = f.y;
+        return (Image)
+        {
+            .pixels  = animated_image.pixels + f.pixel_offset,
+            .width   = f.width,
+            .height  = f.height,
+            .indices = animated_image.indices + f.pixel_offset,
+            .palette = animated_image.palette,
+        };
+    }
     int pixels_per_frame = animated_image.width * animated_image.height;
-    int pixel_offset_to_current_frame = pixels_per_frame * current_frame;
-    Image frame =
+    int pixel_offset_to_current_frame = pixels_per_frame * animation_frame;
+    return (Image)
     {
-        .pixels = animated_image.pixels + pixel_offset_to_current_frame,
-        .width  = animated_image.width,
-        .height = animated_image.height,
+        .pixels  = animated_image.pixels + pixel_offset_to_current_frame,
+        .width   = animated_image.width,
+        .height  = animated_image.height,
+        .indices = animated_image.indices + pixel_offset_to_current_frame,
+        .palette = animated_image.palette,
     };
-    draw_image(frame, x, y);
 }
 
 // Draw a single frame of an animation to the internal buffer.
 void draw_animated_image_frame(Animated_Image animated_image,
     int animation_frame, int x, int y)
 {
-    int pixels_per_frame = animated_image.width * animated_image.height;
-    int pixel_offset_to_current_frame = pixels_per_frame * animation_frame;
-    Image frame =
+    int offset_x, offset_y;
+    Image frame = get_animation_frame(animated_image, animation_frame,
+        &offset_x, &offset_y);
+    if (animated_image.flip & FLIP_HORIZONTAL)
     {
-        .pixels = animated_image.pixels + pixel_offset_to_current_frame,
-        .width  = animated_image.width,
-        .height = animated_image.height,
-    };
-    draw_image(frame, x, y);
+        offset_x = animated_image.width - offset_x - frame.width;
+    }
+    if (animated_image.flip & FLIP_VERTICAL)
+    {
+        offset_y = animated_image.height - offset_y - frame.height;
+    }
+    draw_image_flipped(frame, x + offset_x, y + offset_y, animated_image.flip);
 }
 
-// Draw a selected range of frames of animation, instead of all frames.
-void draw_animated_image_frames(Animated_Image animated_image,
-    int start_frame, int end_frame, int x, int y)
+// Find the coverage spans of every frame of an animation.
+// Returns NULL if there is not enough memory in the pool.
+Coverage_Span * find_animation_coverage(int pool_index, Animated_Image animated_image)
 {
-    int time_passed = SDL_GetTicks() - animated_image.start_time_ms;
-    int frames_passed = time_passed / animated_image.frame_duration_ms;
-    int frame_count = (end_frame - start_frame) + 1;
-    int current_frame = start_frame + (frames_passed % frame_count);
-    int pixels_per_frame = animated_image.width * animated_image.height;
-    int pixel_offset_to_current_frame = pixels_per_frame * current_frame;
-    Image frame =
+    int height = animated_image.height;
+    Coverage_Span * coverage = pool_alloc(pool_index,
+        animated_image.frame_count * height * sizeof(Coverage_Span));
+    if (!coverage) return NULL;
+    set_memory(coverage, animated_image.frame_count * height * sizeof(Coverage_Span), 0);
+
+    for (int frame_index = 0; frame_index < animated_image.frame_count; ++frame_index)
     {
-        .pixels = animated_image.pixels + pixel_offset_to_current_frame,
-        .width  = animated_image.width,
-        .height = animated_image.height,
-    };
-    draw_image(frame, x, y);
+        int offset_x, offset_y;
+        Image frame = get_animation_frame(animated_image, frame_index,
+            &offset_x, &offset_y);
+        for (int y = 0; y < frame.height && offset_y + y < height; ++y)
+        {
+            Coverage_Span * longest = &coverage[frame_index * height + offset_y + y];
+            int run_start = 0;
+            for (int x = 0; x <= frame.width; ++x)
+            {
+                int i = x + y * frame.width;
+                bool opaque = x < frame.width && (frame.palette ?
+                    frame.indices[i] != 0 : get_alpha(frame.pixels[i]) != 0);
+                if (opaque) continue;
+                if (x - run_start > longest->end - longest->start)
+                {
+                    longest->start = offset_x + run_start;
+                    longest->end = offset_x + x;
+                }
+                run_start = x + 1;
+            }
+        }
+    }
+    return coverage;
 }
 
-// Same as above but don't loop, stop and display the final frame once it is complete.
-bool draw_animated_image_frames_and_wait(Animated_Image animated_image,
-    int start_frame, int end_frame, int x, int y)
+// Occlude the background behind the opaque pixels of a frame of an animation,
+// drawn at the given position.
+void occlude_animated_image_frame(Animated_Image animated_image,
+    int animation_frame, int x, int y)
 {
-    bool waiting = false;
-    int time_passed = SDL_GetTicks() - animated_image.start_time_ms;
+    if (!animated_image.coverage) return;
+    Coverage_Span * coverage = animated_image.coverage +
+        animation_frame * animated_image.height;
+    for (int row = 0; row < animated_image.height; ++row)
+    {
+        Coverage_Span span = coverage[row];
+        if (span.start == span.end) continue;
+        if (animated_image.flip & FLIP_HORIZONTAL)
+        {
+            span = (Coverage_Span){
+                animated_image.width - span.end, animated_image.width - span.start };
+        }
+        int screen_y = y + ((animated_image.flip & FLIP_VERTICAL) ?
+            animated_image.height - 1 - row : row);
+        occlude_span(screen_y, x + span.start, x + span.end);
+    }
+}
+
+// Returns the frame to show of a looping range of frames of an animation.
+int get_animation_frames_index(Animated_Image animated_image,
+    int start_frame, int end_frame)
+{
+    if (animated_image.frame_duration_ms == 0) return start_frame;
+    int time_passed = get_ticks() - animated_image.start_time_ms;
     int frames_passed = time_passed / animated_image.frame_duration_ms;
     int frame_count = (end_frame - start_frame) + 1;
-    int current_frame = start_frame + (frames_passed % frame_count);
+    return start_frame + (frames_passed % frame_count);
+}
+
+// Same as above but don't loop, stop on the final frame once it is complete,
+// and set waiting (if it is not NULL).
+int get_animation_frames_and_wait_index(Animated_Image animated_image,
+    int start_frame, int end_frame, bool * waiting)
+{
+    if (waiting) *waiting = false;
+    if (animated_image.frame_duration_ms == 0) return start_frame;
+    int time_passed = get_ticks() - animated_image.start_time_ms;
+    int frames_passed = time_passed / animated_image.frame_duration_ms;
     if (start_frame + frames_passed > end_frame)
     {
-        current_frame = end_frame;
-        waiting = true;
+        if (waiting) *waiting = true;
+        return end_frame;
     }
-    int pixels_per_frame = animated_image.width * animated_image.height;
-    int pixel_offset_to_current_frame = pixels_per_frame * current_frame;
-    Image frame =
-    {
-        .pixels = animated_image.pixels + pixel_offset_to_current_frame,
-        .width  = animated_image.width,
-        .height = animated_image.height,
-    };
-    draw_image(frame, x, y);
+    return start_frame + frames_passed;
+}
+
+// Draw an animated image to the internal buffer. This function expects that
+// the object passed in has appropriate numbers in each of its fields.
+void draw_animated_image(Animated_Image animated_image, int x, int y)
+{
+    int time_passed = get_ticks() - animated_image.start_time_ms;
+    if (animated_image.frame_duration_ms == 0) return;
+    int frames_passed = time_passed / animated_image.frame_duration_ms;
+    int current_frame = frames_passed % animated_image.frame_count;
+    draw_animated_image_frame(animated_image, current_frame, x, y);
+}
+
+// Draw a selected range of frames of animation, instead of all frames.
+void draw_animated_image_frames(Animated_Image animated_image,
+    int start_frame, int end_frame, int x, int y)
+{
+    int current_frame = get_animation_frames_index(animated_image,
+        start_frame, end_frame);
+    draw_animated_image_frame(animated_image, current_frame, x, y);
+}
+
+// Same as above but don't loop, stop and display the final frame once it is complete.
+bool draw_animated_image_frames_and_wait(Animated_Image animated_image,
+    int start_frame, int end_frame, int x, int y)
+{
+    bool waiting;
+    int current_frame = get_animation_frames_and_wait_index(animated_image,
+        start_frame, end_frame, &waiting);
+    draw_animated_image_frame(animated_image, current_frame, x, y);
     return waiting;
 }
 
@@ -231,6 +737,7 @@ Font;
 
 void draw_text(Font font, int x, int y, u32 colour, char * text, ...)
 {
+    PROFILE_ZONE("draw_text");
 #define TEXT_MAX 64
     char formatted_text[TEXT_MAX];
     va_list args;
@@ -262,3 +769,86 @@ void draw_text(Font font, int x, int y, u32 colour, char * text, ...)
         }
     }
 }
+
+//
+// Cached overlays.
+//
+// Interface that is mostly the same from frame to frame can be drawn once into
+// an overlay, and then copied to the screen each frame. Between begin_overlay
+// and end_overlay, everything is drawn into the overlay instead of the screen.
+// The overlay is kept until it is begun with a different key, which should be
+// a hash of everything that the drawing depends on. Only the bounds of what was
+// drawn are copied, skipping transparent pixels.
+//
+
+typedef struct
+{
+    u32 * pixels;   // NULL until first used.
+    u32 * screen_pixels;
+    u64 key;
+    bool valid;
+    int min_x;
+    int min_y;
+    int max_x;      // One past the last pixel drawn.
+    int max_y;
+}
+Overlay;
+
+// Start drawing into an overlay, if its contents are not already for the given
+// key. The overlay's pixels are allocated from a pool the first time.
+// Returns true if the overlay needs to be drawn, in which case end_overlay must
+// be called after drawing it.
+bool begin_overlay(Overlay * overlay, int pool_index, u64 key)
+{
+    if (overlay->valid && overlay->key == key) return false;
+    if (!overlay->pixels)
+    {
+        overlay->pixels = pool_alloc(pool_index, WIDTH * HEIGHT * sizeof(u32));
+        // Without memory, draw straight to the screen every frame instead.
+        if (!overlay->pixels) return true;
+    }
+    set_memory(overlay->pixels, WIDTH * HEIGHT * sizeof(u32), 0);
+    overlay->screen_pixels = pixels;
+    pixels = overlay->pixels;
+    overlay->key = key;
+    return true;
+}
+
+// Finish drawing into an overlay, and find the bounds of what was drawn.
+// Pixels that are entirely zero count as not drawn.
+void end_overlay(Overlay * overlay)
+{
+    if (!overlay->pixels) return;
+    pixels = overlay->screen_pixels;
+    overlay->min_x = WIDTH;
+    overlay->min_y = HEIGHT;
+    overlay->max_x = 0;
+    overlay->max_y = 0;
+    for (int y = 0; y < HEIGHT; ++y)
+    {
+        for (int x = 0; x < WIDTH; ++x)
+        {
+            if (overlay->pixels[x + y * WIDTH])
+            {
+                overlay->min_x = min(overlay->min_x, x);
+                overlay->min_y = min(overlay->min_y, y);
+                overlay->max_x = max(overlay->max_x, x + 1);
+                overlay->max_y = max(overlay->max_y, y + 1);
+            }
+        }
+    }
+    overlay->valid = true;
+}
+
+// Copy an overlay to the internal buffer.
+void draw_overlay(Overlay * overlay)
+{
+    if (!overlay->valid) return;
+    PROFILE_ZONE("draw_overlay");
+    for (int y = overlay->min_y; y < overlay->max_y; ++y)
+    {
+        blit_row(pixels + overlay->min_x + y * WIDTH,
+            overlay->pixels + overlay->min_x + y * WIDTH,
+            overlay->max_x - overlay->min_x);
+    }
+}
@@ -0,0 +1,517 @@
+//
+// input.c
+//
+// This file contains:
+//     - Lock-free input event queue.
+//     - Input sampling thread.
+//     - Immediate input feedback.
+//     - Linux evdev input backend.
+//
+
+//
+// Input.
+//
+// Button presses are judged to the microsecond, so they are not left waiting
+// for the next frame. Joysticks are sampled on their own thread every
+// INPUT_SAMPLE_INTERVAL_NS. The keyboard is read when the game thread handles
+// SDL's events, which the pacer does every PACE_INPUT_CHECK_NS while it waits
+// for the next frame (see pacing.c), so a key press can only be held up while
+// a frame is being made. Each press or release is given a time stamp from
+// CLOCK_MONOTONIC (see get_time_ns) and put in a queue, which the game thread
+// empties once per frame and passes on to the current scene's input function.
+//
+// Each queue has just one thread writing and one reading, so no locks are
+// needed: the writer only moves write_index, and the reader only moves
+// read_index. Each source of input has its own queue, and events are taken
+// from whichever holds the earliest.
+//
+// Some responses, such as the sound of a hit, should not wait for the game
+// thread at all. A scene can give a feedback function, which is called from
+// the thread that saw the input the moment it is seen. Feedback functions are
+// not given the scene state, as the game thread may be using it.
+//
+
+// Must be a power of two.
+#define INPUT_QUEUE_SIZE 256
+#define INPUT_SAMPLE_INTERVAL_NS 500000ull
+#define MAX_JOYSTICKS 8
+#define MAX_JOYSTICK_BUTTONS 32
+
+typedef struct
+{
+    u64 time_stamp_us;
+    int player;
+    bool pressed;
+}
+Input_Event;
+
+typedef struct
+{
+    Input_Event events[INPUT_QUEUE_SIZE];
+    u32 write_index;
+    u32 read_index;
+}
+Input_Queue;
+
+typedef enum
+{
+    INPUT_SOURCE_KEYBOARD,
+    INPUT_SOURCE_JOYSTICK,
+    INPUT_SOURCE_EVDEV,
+    INPUT_SOURCE_COUNT,
+}
+Input_Source;
+
+typedef enum
+{
+    INPUT_BACKEND_SDL,
+    INPUT_BACKEND_EVDEV,
+    INPUT_BACKEND_COUNT,
+}
+Input_Backend;
+
+char * input_backend_names[INPUT_BACKEND_COUNT] =
+{
+    [INPUT_BACKEND_SDL] = "sdl",
+    [INPUT_BACKEND_EVDEV] = "evdev",
+};
+
+typedef void (* Feedback_Func)(int player, bool pressed);
+
+struct
+{
+    SDL_Thread * thread;
+    Input_Backend backend;
+    Input_Queue queues[INPUT_SOURCE_COUNT];
+    Feedback_Func feedback;
+    // Guarded by SDL_LockJoysticks.
+    SDL_Joystick * joysticks[MAX_JOYSTICKS];
+    u32 button_states[MAX_JOYSTICKS];
+    int joystick_count;
+    u64 dropped_event_count;
+}
+input;
+
+// Convert an input time stamp to game clock milliseconds (see get_ticks).
+u32 input_time_to_ticks(u64 time_stamp_us)
+{
+    return real_to_game_time_us(time_stamp_us) / 1000;
+}
+
+// Add an event to a queue. Only one thread may write to each queue.
+// Returns false if the queue is full.
+bool push_input_event(Input_Queue * queue, Input_Event event)
+{
+    u32 write_index = __atomic_load_n(&queue->write_index, __ATOMIC_RELAXED);
+    u32 read_index = __atomic_load_n(&queue->read_index, __ATOMIC_ACQUIRE);
+    if (write_index - read_index == INPUT_QUEUE_SIZE) return false;
+    queue->events[write_index & (INPUT_QUEUE_SIZE - 1)] = event;
+    __atomic_store_n(&queue->write_index, write_index + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Look at the next event in a queue without taking it.
+// Returns NULL if the queue is empty.
+static Input_Event * peek_input_event(Input_Queue * queue)
+{
+    u32 read_index = __atomic_load_n(&queue->read_index, __ATOMIC_RELAXED);
+    u32 write_index = __atomic_load_n(&queue->write_index, __ATOMIC_ACQUIRE);
+    if (read_index == write_index) return NULL;
+    return &queue->events[read_index & (INPUT_QUEUE_SIZE - 1)];
+}
+
+static void skip_input_event(Input_Queue * queue)
+{
+    u32 read_index = __atomic_load_n(&queue->read_index, __ATOMIC_RELAXED);
+    __atomic_store_n(&queue->read_index, read_index + 1, __ATOMIC_RELEASE);
+}
+
+// Take the earliest waiting input event. Must only be called from the game
+// thread. Returns false if there are none.
+bool next_input_event(Input_Event * event)
+{
+    Input_Queue * earliest_queue = NULL;
+    Input_Event * earliest = NULL;
+    for (int source = 0; source < INPUT_SOURCE_COUNT; ++source)
+    {
+        Input_Event * next = peek_input_event(&input.queues[source]);
+        if (next && (!earliest || next->time_stamp_us < earliest->time_stamp_us))
+        {
+            earliest_queue = &input.queues[source];
+            earliest = next;
+        }
+    }
+    if (!earliest) return false;
+
+    *event = *earliest;
+    skip_input_event(earliest_queue);
+    return true;
+}
+
+// Record a press or release, and give immediate feedback for it.
+static void receive_input(Input_Source source, int player, bool pressed,
+    u64 time_stamp_us)
+{
+    Input_Event event = { time_stamp_us, player, pressed };
+    if (!push_input_event(&input.queues[source], event))
+    {
+        __atomic_add_fetch(&input.dropped_event_count, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    Feedback_Func feedback = __atomic_load_n(&input.feedback, __ATOMIC_ACQUIRE);
+    if (feedback) feedback(player, pressed);
+}
+
+// Set the function called straight away for each input (may be NULL).
+void set_input_feedback(Feedback_Func feedback)
+{
+    __atomic_store_n(&input.feedback, feedback, __ATOMIC_RELEASE);
+}
+
+// Called by SDL as each event arrives, before it is queued.
+static int keyboard_event_watch(void * data, SDL_Event * event)
+{
+    if ((event->type == SDL_KEYDOWN || event->type == SDL_KEYUP) && !event->key.repeat)
+    {
+        SDL_Scancode sc = event->key.keysym.scancode;
+        if (sc == SDL_SCANCODE_LSHIFT || sc == SDL_SCANCODE_RSHIFT)
+        {
+            receive_input(INPUT_SOURCE_KEYBOARD, sc == SDL_SCANCODE_RSHIFT,
+                event->key.state, get_time_us());
+        }
+    }
+    return 0;
+}
+
+// Start sampling a joystick that has been connected.
+void add_input_joystick(int device_index)
+{
+    SDL_Joystick * joystick = SDL_JoystickOpen(device_index);
+    if (!joystick) return;
+    SDL_LockJoysticks();
+    // Joysticks that are already open are announced again when SDL starts.
+    bool known = false;
+    for (int i = 0; i < input.joystick_count; ++i)
+    {
+        if (input.joysticks[i] == joystick) known = true;
+    }
+    if (known)
+    {
+        SDL_JoystickClose(joystick);
+    }
+    else if (input.joystick_count < MAX_JOYSTICKS)
+    {
+        input.joysticks[input.joystick_count] = joystick;
+        input.button_states[input.joystick_count] = 0;
+        ++input.joystick_count;
+    }
+    SDL_UnlockJoysticks();
+}
+
+// Stop sampling a joystick that has been disconnected.
+void remove_input_joystick(SDL_JoystickID id)
+{
+    SDL_LockJoysticks();
+    for (int i = 0; i < input.joystick_count; ++i)
+    {
+        if (SDL_JoystickInstanceID(input.joysticks[i]) == id)
+        {
+            SDL_JoystickClose(input.joysticks[i]);
+            --input.joystick_count;
+            input.joysticks[i] = input.joysticks[input.joystick_count];
+            input.button_states[i] = input.button_states[input.joystick_count];
+            break;
+        }
+    }
+    SDL_UnlockJoysticks();
+}
+
+static int input_thread(void * data)
+{
+    SDL_SetThreadPriority(SDL_THREAD_PRIORITY_HIGH);
+    set_profile_thread_name("input");
+    u64 next_sample_ns = get_time_ns();
+    while (true)
+    {
+        next_sample_ns += INPUT_SAMPLE_INTERVAL_NS;
+        sleep_until_ns(next_sample_ns);
+        PROFILE_ZONE("sample_joysticks");
+        u64 time_stamp_us = get_time_us();
+
+        SDL_LockJoysticks();
+        SDL_JoystickUpdate();
+        for (int i = 0; i < input.joystick_count; ++i)
+        {
+            SDL_Joystick * joystick = input.joysticks[i];
+            int player = SDL_JoystickInstanceID(joystick) & 1;
+            int button_count = min(SDL_JoystickNumButtons(joystick), MAX_JOYSTICK_BUTTONS);
+            for (int button = 0; button < button_count; ++button)
+            {
+                u32 mask = 1u << button;
+                bool pressed = SDL_JoystickGetButton(joystick, button);
+                if (pressed != !!(input.button_states[i] & mask))
+                {
+                    input.button_states[i] ^= mask;
+                    receive_input(INPUT_SOURCE_JOYSTICK, player, pressed, time_stamp_us);
+                }
+            }
+        }
+        SDL_UnlockJoysticks();
+
+        // Fall back into step after a long stall, rather than rushing.
+        u64 now_ns = get_time_ns();
+        if (now_ns > next_sample_ns + INPUT_SAMPLE_INTERVAL_NS) next_sample_ns = now_ns;
+    }
+    return 0;
+}
+
+//
+// Linux evdev backend.
+//
+// On Linux, input devices can be read straight from /dev/input/event*,
+// without going through SDL at all. The kernel stamps each event as it comes
+// from the device, so the time stamps do not depend on when the game gets
+// around to reading them. EVIOCSCLOCKID sets the stamps to CLOCK_MONOTONIC,
+// the same clock as get_time_ns. The evdev thread sleeps in poll until a
+// device has something to read, and looks for newly connected devices every
+// EVDEV_SCAN_INTERVAL_NS.
+//
+// On keyboards, the left and right shift keys are players 0 and 1. Gamepads
+// and joysticks take turns being player 0 and 1 in the order that they are
+// found, as SDL instance IDs do. Devices are read even when the window does
+// not have focus, and the user needs permission to read them (usually by being
+// in the input group). If no device can be opened, SDL is used instead.
+//
+// The backend can be tried without hardware by creating a virtual device with
+// uinput that has KEY_LEFTSHIFT and KEY_RIGHTSHIFT (or BTN_SOUTH) and writing
+// key events to it. It is picked up by the next scan. evdev_check.c does this
+// to check the backend.
+//
+
+#ifdef __linux__
+
+#include <dirent.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+
+// Older kernel headers only have the time as a struct timeval.
+#ifndef input_event_sec
+#define input_event_sec time.tv_sec
+#define input_event_usec time.tv_usec
+#endif
+
+#define MAX_EVDEV_DEVICES 16
+#define EVDEV_SCAN_INTERVAL_NS 1000000000ull
+
+typedef enum
+{
+    EVDEV_KEYBOARD,
+    EVDEV_GAMEPAD,
+}
+Evdev_Kind;
+
+typedef struct
+{
+    int file;
+    int number;
+    Evdev_Kind kind;
+    int player;
+}
+Evdev_Device;
+
+struct
+{
+    Evdev_Device devices[MAX_EVDEV_DEVICES];
+    int device_count;
+    int gamepad_count;
+}
+evdev;
+
+static bool test_bit(u8 * bits, int bit)
+{
+    return bits[bit / 8] & (1 << (bit % 8));
+}
+
+// Start reading a device that is already open, if it has buttons that the
+// game can use. Returns false (and closes the file) if it was not added.
+bool add_evdev_device(int file, int number)
+{
+    u8 keys[KEY_MAX / 8 + 1] = {};
+    int clock = CLOCK_MONOTONIC;
+    if (evdev.device_count == MAX_EVDEV_DEVICES ||
+        ioctl(file, EVIOCGBIT(EV_KEY, sizeof(keys)), keys) < 0 ||
+        ioctl(file, EVIOCSCLOCKID, &clock) < 0)
+    {
+        close(file);
+        return false;
+    }
+
+    Evdev_Device device = { .file = file, .number = number };
+    if (test_bit(keys, KEY_LEFTSHIFT) && test_bit(keys, KEY_RIGHTSHIFT))
+    {
+        device.kind = EVDEV_KEYBOARD;
+    }
+    else if (test_bit(keys, BTN_GAMEPAD) || test_bit(keys, BTN_JOYSTICK))
+    {
+        device.kind = EVDEV_GAMEPAD;
+        device.player = evdev.gamepad_count++ & 1;
+    }
+    else
+    {
+        close(file);
+        return false;
+    }
+    evdev.devices[evdev.device_count++] = device;
+    return true;
+}
+
+// Open any event devices that are not already being read.
+void scan_evdev_devices()
+{
+    DIR * directory = opendir("/dev/input");
+    if (!directory) return;
+    struct dirent * entry;
+    while ((entry = readdir(directory)))
+    {
+        int number;
+        if (sscanf(entry->d_name, "event%d", &number) != 1) continue;
+        bool known = false;
+        for (int i = 0; i < evdev.device_count; ++i)
+        {
+            if (evdev.devices[i].number == number) known = true;
+        }
+        if (known) continue;
+
+        char path[sizeof("/dev/input/") + sizeof(entry->d_name)];
+        snprintf(path, sizeof(path), "/dev/input/%s", entry->d_name);
+        int file = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (file >= 0) add_evdev_device(file, number);
+    }
+    closedir(directory);
+}
+
+// Pass on the button events waiting on a device.
+// Returns false if the device has gone.
+bool read_evdev_device(Evdev_Device * device)
+{
+    struct input_event events[64];
+    while (true)
+    {
+        int byte_count = read(device->file, events, sizeof(events));
+        if (byte_count == 0) return false;
+        if (byte_count < 0) return errno == EAGAIN || errno == EINTR;
+
+        for (int i = 0; i < byte_count / sizeof(events[0]); ++i)
+        {
+            struct input_event * event = &events[i];
+            // A value of 2 is a key repeat.
+            if (event->type != EV_KEY || event->value > 1) continue;
+
+            int player = device->player;
+            if (device->kind == EVDEV_KEYBOARD)
+            {
+                if (event->code == KEY_LEFTSHIFT) player = 0;
+                else if (event->code == KEY_RIGHTSHIFT) player = 1;
+                else continue;
+            }
+            else if (event->code < BTN_JOYSTICK || event->code > BTN_THUMBR)
+            {
+                continue;
+            }
+
+            u64 time_stamp_us = event->input_event_sec * 1000000ull
+                + event->input_event_usec;
+            receive_input(INPUT_SOURCE_EVDEV, player, event->value, time_stamp_us);
+        }
+    }
+}
+
+static int evdev_thread(void * data)
+{
+    SDL_SetThreadPriority(SDL_THREAD_PRIORITY_HIGH);
+    set_profile_thread_name("evdev input");
+    u64 next_scan_ns = get_time_ns() + EVDEV_SCAN_INTERVAL_NS;
+    while (true)
+    {
+        struct pollfd polls[MAX_EVDEV_DEVICES];
+        int poll_count = evdev.device_count;
+        for (int i = 0; i < poll_count; ++i)
+        {
+            polls[i] = (struct pollfd){ .fd = evdev.devices[i].file, .events = POLLIN };
+        }
+        poll(polls, poll_count, EVDEV_SCAN_INTERVAL_NS / 1000000);
+
+        // Go backwards, so that removing a device does not skip the next one.
+        for (int i = poll_count - 1; i >= 0; --i)
+        {
+            if (!polls[i].revents) continue;
+            if (!(polls[i].revents & POLLIN) || !read_evdev_device(&evdev.devices[i]))
+            {
+                close(evdev.devices[i].file);
+                evdev.devices[i] = evdev.devices[--evdev.device_count];
+            }
+        }
+
+        if (get_time_ns() >= next_scan_ns)
+        {
+            scan_evdev_devices();
+            next_scan_ns = get_time_ns() + EVDEV_SCAN_INTERVAL_NS;
+        }
+    }
+    return 0;
+}
+
+// Returns false if no devices could be read.
+bool start_evdev_input()
+{
+    scan_evdev_devices();
+    if (!evdev.device_count) return false;
+    input.thread = SDL_CreateThread(evdev_thread, "evdev input", NULL);
+    return input.thread != NULL;
+}
+
+#else
+
+bool start_evdev_input() { return false; }
+
+#endif
+
+//
+// Starting input.
+//
+
+// Find an input backend by name. Returns INPUT_BACKEND_COUNT if there is none.
+Input_Backend find_input_backend(char * name)
+{
+    for (int backend = 0; backend < INPUT_BACKEND_COUNT; ++backend)
+    {
+        if (strcmp(name, input_backend_names[backend]) == 0) return backend;
+    }
+    return INPUT_BACKEND_COUNT;
+}
+
+// Start reading input with the given backend, or SDL if that is not possible.
+// Should be called after SDL has been initialised.
+// Returns false if the input thread could not be started.
+bool start_input(Input_Backend backend)
+{
+    // Joystick buttons are read by the input thread, so SDL need not queue them.
+    SDL_EventState(SDL_JOYBUTTONDOWN, SDL_IGNORE);
+    SDL_EventState(SDL_JOYBUTTONUP, SDL_IGNORE);
+
+    if (backend == INPUT_BACKEND_EVDEV)
+    {
+        if (start_evdev_input())
+        {
+            input.backend = INPUT_BACKEND_EVDEV;
+            return true;
+        }
+        printf("Could not read the input devices directly, so using SDL.\n");
+    }
+
+    input.backend = INPUT_BACKEND_SDL;
+    SDL_AddEventWatch(keyboard_event_watch, NULL);
+    input.thread = SDL_CreateThread(input_thread, "input", NULL);
+    return input.thread != NULL;
+}
@@ -4,30 +4,79 @@
 // This file contains:
 //     - Program entry point
 //     - Initialisation for graphics and audio.
+//     - Event handling.
 //     - Frame loop.
+//     - Headless loop.
+//     - Replay loop.
 //     - Main audio callback.
 //
 
-// Compile time options for the memory allocator.
+// Define HOT_RELOAD to have changed asset files reloaded while the game runs.
+// #define HOT_RELOAD
+#define HOT_RELOAD_RESERVE_BYTE_COUNT megabytes(8)
+
+// Compile time options for the memory allocator. Hot reloading needs room in
+// the persistent pool for its reserve pool.
 #define POOL_STATIC_ALLOCATE
+#ifdef HOT_RELOAD
+#define POOL_STATIC_PERSIST_BYTE_COUNT (48 * 1000 * 1000)
+#else
 #define POOL_STATIC_PERSIST_BYTE_COUNT (32 * 1000 * 1000)
+#endif
+// Each thread's scratch pool (see init_thread_pools) is taken from the
+// persistent pool, so they are kept small.
+#define THREAD_POOL_BYTE_COUNT (256 * 1024)
+
+// A snapshot of the game is taken at this interval, and enough of them are
+// kept to rewind by a few seconds. R rewinds by SNAPSHOT_REWIND_STEPS
+// snapshots, which is a fixed number of seconds rather than of bars, since
+// each scene keeps its own tempo.
+#define SNAPSHOT_COUNT 8
+#define SNAPSHOT_INTERVAL_MS 1000
+#define SNAPSHOT_REWIND_STEPS 4
+
+// Define PROFILE to record timing zones (see profile.c). F1 shows the zones of
+// the last frame, and F2 writes a Chrome trace to the --trace file. The bench
+// build times its phases with the zones, so build.sh defines it for that.
+// #define PROFILE
+#define PROFILE_DEFAULT_TRACE_FILE_NAME "trace.json"
+
+#define AUDIO_SAMPLE_RATE 48000
 
 // External includes here:
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <errno.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 #include <SDL2/SDL.h>
 
 // The entire project is a single compilation unit.
 // Everything is included here:
 #include "common.c"
 #include "memory.c"
+#include "profile.c"
+#include "compress.c"
 #include "graphics.c"
 #include "audio.c"
 #include "assets.c"
+#include "pacing.c"
+#include "input.c"
 #include "scene.c"
+#include "reload.c"
+#include "replay.c"
 
 //
 // Main audio callback.
@@ -35,40 +84,73 @@
 
 void audio_callback(void * data, u8 * stream, int byte_count)
 {
+    set_profile_thread_name("audio");
+    PROFILE_ZONE("audio_callback");
     Mixer * mixer = data;
     f32 * samples = (f32 *)stream;
     int sample_count = byte_count / sizeof(f32);
     mix_audio(mixer, samples, sample_count);
 }
 
+// Without an audio device, the mixer is run along with the game clock into a
+// buffer that is thrown away, so that sounds start and finish when they would
+// have and the mixing costs what it would have.
+// Call once each time the game clock is stepped.
+void mix_audio_offline()
+{
+    static f32 samples[2 * 512];
+    // Part of a frame of audio that was due but not yet mixed, scaled by a
+    // million, so that no time is lost to rounding.
+    static u64 remainder;
+    u64 due = game_clock.real_delta_us * AUDIO_SAMPLE_RATE + remainder;
+    remainder = due % 1000000;
+    u64 due_frame_count = due / 1000000;
+    while (due_frame_count > 0)
+    {
+        int frame_count = min(due_frame_count, 512);
+        mix_audio(&mixer, samples, frame_count * 2);
+        due_frame_count -= frame_count;
+    }
+}
+
 //
-// Program entry point.
+// Initialisation for graphics and audio.
+//
+// With the headless platform there is no window, renderer or audio device, so
+// the game can run on machines without a display. Frames are only drawn into
+// the pixel buffer, and audio is mixed offline.
 //
 
-int main(int argument_count, char ** arguments)
+typedef enum
 {
-    // Use unbuffered logging.
-    setbuf(stdout, 0);
-
-    //
-    // Initialisation.
-    //
+    PLATFORM_SDL,
+    PLATFORM_HEADLESS,
+    PLATFORM_COUNT,
+}
+Platform;
 
-    if (!init_memory_pools(megabytes(32), megabytes(8), megabytes(4)))
-    {
-        panic_exit("Could not initialise memory pools.");
-    }
+char * platform_names[PLATFORM_COUNT] =
+{
+    [PLATFORM_SDL] = "sdl",
+    [PLATFORM_HEADLESS] = "headless",
+};
 
-    if (SDL_Init(SDL_INIT_EVERYTHING) != 0)
+Platform find_platform(char * name)
+{
+    for (int platform = 0; platform < PLATFORM_COUNT; ++platform)
     {
-        panic_exit("Could not initialise SDL2.\n%s", SDL_GetError());
+        if (strcmp(name, platform_names[platform]) == 0) return platform;
     }
+    return PLATFORM_COUNT;
+}
 
-    //
-    // Init graphics.
-    //
+SDL_Window * window;
+SDL_Renderer * renderer;
+SDL_Texture * screen_texture;
 
-    SDL_Window * window = SDL_CreateWindow("",
+void init_display(bool vsync)
+{
+    window = SDL_CreateWindow("",
         SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
         WIDTH * 2, HEIGHT * 2, SDL_WINDOW_RESIZABLE);
     if (!window)
@@ -78,8 +160,9 @@ int main(int argument_count, char ** arguments)
 
     SDL_SetWindowMinimumSize(window, WIDTH, HEIGHT);
 
-    SDL_Renderer * renderer = SDL_CreateRenderer(window, -1,
-        SDL_RENDERER_ACCELERATED /*| SDL_RENDERER_PRESENTVSYNC*/);
+    u32 renderer_flags = SDL_RENDERER_ACCELERATED;
+    if (vsync) renderer_flags |= SDL_RENDERER_PRESENTVSYNC;
+    renderer = SDL_CreateRenderer(window, -1, renderer_flags);
     if (!renderer)
     {
         panic_exit("Could not create a rendering context.\n%s", SDL_GetError());
@@ -88,7 +171,7 @@ int main(int argument_count, char ** arguments)
     SDL_RenderSetLogicalSize(renderer, WIDTH, HEIGHT);
     SDL_RenderSetIntegerScale(renderer, true);
 
-    SDL_Texture * screen_texture = SDL_CreateTexture(renderer,
+    screen_texture = SDL_CreateTexture(renderer,
         SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING,
         WIDTH, HEIGHT);
     if (!screen_texture)
@@ -96,20 +179,14 @@ int main(int argument_count, char ** arguments)
         panic_exit("Could not create the screen texture.\n%s", SDL_GetError());
     }
 
-    pixels = pool_alloc(PERSIST_POOL, WIDTH * HEIGHT * sizeof(u32));
-    set_memory(pixels, WIDTH * HEIGHT * sizeof(u32), 0);
-
     SDL_ShowCursor(false);
+}
 
-    //
-    // Init audio.
-    //
-
-    mixer = create_mixer(PERSIST_POOL, 64, 1.0);
-
+void open_audio_device()
+{
     SDL_AudioSpec audio_output_spec =
     {
-        .freq = 48000,
+        .freq = AUDIO_SAMPLE_RATE,
         .format = AUDIO_F32,
         .channels = 2,
         .samples = 64,
@@ -125,13 +202,490 @@ int main(int argument_count, char ** arguments)
     }
 
     SDL_PauseAudioDevice(audio_device, false);
+}
+
+//
+// Event handling.
+//
+
+u32 next_snapshot_time_ms;
+
+#ifdef PROFILE
+// Set by --trace, to have a trace written when the game ends.
+char * profile_trace_file_name;
+
+void save_profile_trace()
+{
+    char * file_name = profile_trace_file_name ?
+        profile_trace_file_name : PROFILE_DEFAULT_TRACE_FILE_NAME;
+    if (write_profile_trace(file_name))
+    {
+        printf("Wrote a profile trace to %s.\n", file_name);
+    }
+    else
+    {
+        issue_warning("Could not write a profile trace to %s.", file_name);
+    }
+}
+#endif
+
+void quit_game()
+{
+    finish_recording();
+#ifdef PROFILE
+    if (profile_trace_file_name) save_profile_trace();
+#endif
+#ifdef DEBUG
+    print_memory_stats();
+    print_pacing_stats();
+#endif
+    exit(0);
+}
+
+// DEBUG: Keys for moving around the game while working on it.
+void handle_debug_key(SDL_Scancode sc)
+{
+    if (sc == SDL_SCANCODE_1)
+    {
+        set_scene(heart_scene);
+    }
+    else if (sc == SDL_SCANCODE_2)
+    {
+        set_scene(lungs_scene);
+    }
+    else if (sc == SDL_SCANCODE_3)
+    {
+        set_scene(digestion_scene);
+    }
+    else if (sc == SDL_SCANCODE_I)
+    {
+        heart_state.draw_interface = !heart_state.draw_interface;
+        lungs_state.draw_interface = !lungs_state.draw_interface;
+        digestion_state.draw_interface = !digestion_state.draw_interface;
+    }
+    else if (sc == SDL_SCANCODE_O)
+    {
+        heart_state.target_beats_per_minute += 10;
+    }
+    else if (sc == SDL_SCANCODE_R)
+    {
+        restore_snapshot(SNAPSHOT_REWIND_STEPS);
+        next_snapshot_time_ms = get_ticks() + SNAPSHOT_INTERVAL_MS;
+    }
+    else if (sc == SDL_SCANCODE_P)
+    {
+        set_game_clock_paused(!game_clock.paused);
+    }
+    else if (sc == SDL_SCANCODE_MINUS)
+    {
+        set_game_clock_scale(game_clock.scale / 2.0);
+    }
+    else if (sc == SDL_SCANCODE_EQUALS)
+    {
+        set_game_clock_scale(game_clock.scale * 2.0);
+    }
+}
+
+// Pass on input to the current scene, and handle the debug keys.
+// Returns true if there were any events.
+bool handle_events()
+{
+    bool handled = false;
+    SDL_Event event;
+    while (SDL_PollEvent(&event))
+    {
+        handled = true;
+        if (event.type == SDL_QUIT)
+        {
+            quit_game();
+        }
+        else if (event.type == SDL_KEYDOWN)
+        {
+            // The player keys are picked up by the input system (see input.c).
+#ifdef PROFILE
+            // These do not change the game, so are not recorded.
+            SDL_Scancode sc = event.key.keysym.scancode;
+            if (sc == SDL_SCANCODE_F1 || sc == SDL_SCANCODE_F2)
+            {
+                if (event.key.repeat) continue;
+                if (sc == SDL_SCANCODE_F1) profiler.show_overlay = !profiler.show_overlay;
+                else save_profile_trace();
+                continue;
+            }
+#endif
+            if (!event.key.repeat)
+            {
+                record_key(event.key.keysym.scancode);
+                handle_debug_key(event.key.keysym.scancode);
+            }
+        }
+        else if (event.type == SDL_JOYDEVICEADDED)
+        {
+            add_input_joystick(event.jdevice.which);
+        }
+        else if (event.type == SDL_JOYDEVICEREMOVED)
+        {
+            remove_input_joystick(event.jdevice.which);
+        }
+    }
+
+    // Pass on the presses and releases from the input system, in order.
+    Input_Event input_event;
+    while (next_input_event(&input_event))
+    {
+        handled = true;
+        record_input(input_event.player, input_event.pressed,
+            input_event.time_stamp_us);
+        PROFILE_ZONE("scene_input");
+        current_scene.input(current_scene.state, input_event.player,
+            input_event.pressed, input_event.time_stamp_us);
+    }
+    return handled;
+}
+
+//
+// Frame loop.
+//
+
+void start_game()
+{
+    blank_cut(3.0, 0, &heart_scene, NULL);
+    play_sound(&mixer, get_sound(find_sound("clock")), 1.0, 1.0, true);
+    next_snapshot_time_ms = get_ticks() + SNAPSHOT_INTERVAL_MS;
+}
+
+#ifdef PROFILE
+#define PROFILE_OVERLAY_LINE_COUNT 20
+
+// The frame with the profiler overlay drawn over it. The overlay is kept out of
+// the frame itself, which is recorded, hashed and compared by the pacer.
+u32 * profile_overlay_pixels;
+
+// If the overlay is shown, copy the frame and draw the zones of the last frame
+// over the copy, with how long each took in total and how many times it was
+// entered, indented by how deep it was.
+// Returns the pixels to show on the screen.
+u32 * draw_profile_overlay()
+{
+    if (!profiler.show_overlay) return pixels;
+    PROFILE_ZONE("profile_overlay");
+    if (!profile_overlay_pixels)
+    {
+        profile_overlay_pixels = pool_alloc(PERSIST_POOL, WIDTH * HEIGHT * sizeof(u32));
+        if (!profile_overlay_pixels) return pixels;
+    }
+    memcpy(profile_overlay_pixels, pixels, WIDTH * HEIGHT * sizeof(u32));
+    u32 * frame_pixels = pixels;
+    pixels = profile_overlay_pixels;
+
+    Font font = get_font(find_font("main_font"));
+    Profile_Summary_Line lines[PROFILE_OVERLAY_LINE_COUNT];
+    int line_count = summarise_last_profile_frame(lines, PROFILE_OVERLAY_LINE_COUNT);
+    u64 last_ns, longest_ns;
+    get_profile_frame_times(&last_ns, &longest_ns);
+
+    int x = 4, y = 4;
+    draw_text(font, x, y, ~0, "Frame: %.2fms (longest %.2fms)",
+        last_ns / 1000000.0, longest_ns / 1000000.0);
+    for (int i = 0; i < line_count; ++i)
+    {
+        y += font.char_height + 1;
+        draw_text(font, x + lines[i].depth * font.char_width, y, ~0,
+            "%s: %.2fms x%u", lines[i].name, lines[i].total_ns / 1000000.0,
+            lines[i].call_count);
+    }
+
+    pixels = frame_pixels;
+    return profile_overlay_pixels;
+}
+#endif
+
+// Run one frame of the game, once the game clock has been stepped.
+void run_frame()
+{
+    PROFILE_ZONE("run_frame");
+
+    // Periodically capture the game state, so that it can be rewound.
+    if (get_ticks() >= next_snapshot_time_ms)
+    {
+        take_snapshot();
+        next_snapshot_time_ms += SNAPSHOT_INTERVAL_MS;
+    }
+
+    // Swap in any assets that have changed on disk.
+    apply_asset_reloads();
+
+    // Update and render the scene.
+    run_scene(game_clock.delta_us / 1000000.0f);
+
+#ifdef DEBUG
+    draw_text(get_font(find_font("main_font")), 270, 226, ~0,
+        "FPS: %.0f", 1000000.0f / max(game_clock.real_delta_us, 1));
+#endif
+}
+
+//
+// Headless loop.
+//
+
+// Run the game without a display for a number of frames, as fast as possible.
+// The game clock moves on by a fixed step each frame, so every run draws the
+// same frames. If dump_directory is set, each frame is written to it as a
+// .pam file.
+// Returns the exit code for the program.
+int run_headless(u64 frame_count, int frames_per_second, char * dump_directory)
+{
+    Image frame = { NULL, WIDTH, HEIGHT };
+    if (dump_directory)
+    {
+        frame.pixels = pool_alloc(PERSIST_POOL, WIDTH * HEIGHT * sizeof(u32));
+    }
+
+    u64 frame_step_us = 1000000 / frames_per_second;
+    u64 start_ns = get_time_ns();
+    for (u64 frame_index = 0; frame_index < frame_count; ++frame_index)
+    {
+        mark_profile_frame();
+        advance_game_clock(frame_step_us);
+        record_frame();
+        run_frame();
+        mix_audio_offline();
+
+        if (dump_directory)
+        {
+            // Put the channels back in the order they are in the file.
+            memcpy(frame.pixels, pixels, WIDTH * HEIGHT * sizeof(u32));
+            agbr_to_rgba(frame.pixels, WIDTH * HEIGHT);
+            char file_name[1024];
+            snprintf(file_name, sizeof(file_name), "%s/%06llu.pam",
+                dump_directory, (unsigned long long)frame_index);
+            if (!write_image_file(frame, file_name))
+            {
+                panic_exit("Could not write the frame %s.", file_name);
+            }
+        }
+    }
+
+    f64 seconds = (get_time_ns() - start_ns) / 1000000000.0;
+    printf("Ran %llu frames (%.2fs of play) in %.2fs, %.0f frames per second.\n",
+        (unsigned long long)frame_count, game_clock.real_time_us / 1000000.0, seconds,
+        frame_count / max(seconds, 0.000001));
+    printf("Frame: %016llx\n", (unsigned long long)hash_frame());
+    finish_recording();
+    return 0;
+}
+
+//
+// Replay loop.
+//
+
+// Run the game from the replay log as fast as possible, then check that it
+// ended up the same as when it was recorded.
+// Returns the exit code for the program.
+int run_replay()
+{
+    u64 frame_count = 0;
+    u64 start_ns = get_time_ns();
+    Replay_Record record;
+    while (next_replay_record(&record))
+    {
+        if (record.kind == REPLAY_FRAME)
+        {
+            mark_profile_frame();
+            run_frame();
+            mix_audio_offline();
+            ++frame_count;
+        }
+        else if (record.kind == REPLAY_INPUT)
+        {
+            if (current_scene.feedback) current_scene.feedback(record.code, record.pressed);
+            current_scene.input(current_scene.state, record.code,
+                record.pressed, get_replay_time_stamp(&record));
+        }
+        else if (record.kind == REPLAY_KEY)
+        {
+            handle_debug_key(record.code);
+        }
+        else if (record.kind == REPLAY_END)
+        {
+            Replay_Hashes recorded;
+            if (!read_replay_hashes(&recorded)) break;
+            u64 state_hash = hash_scene_state();
+            u64 frame_hash = hash_frame();
+            printf("Replayed %llu frames (%.2fs of play) in %.2fs.\n",
+                (unsigned long long)frame_count, game_clock.real_time_us / 1000000.0,
+                (get_time_ns() - start_ns) / 1000000000.0);
+            printf("State: %016llx (recorded %016llx)\n",
+                (unsigned long long)state_hash, (unsigned long long)recorded.state_hash);
+            printf("Frame: %016llx (recorded %016llx)\n",
+                (unsigned long long)frame_hash, (unsigned long long)recorded.frame_hash);
+            bool match = state_hash == recorded.state_hash && frame_hash == recorded.frame_hash;
+            printf(match ? "The replay matches.\n" : "The replay does not match!\n");
+            return match ? 0 : 1;
+        }
+    }
+    printf("The replay log ended early.\n");
+    return 1;
+}
+
+// The bench build runs the scene benchmarks instead of the game.
+#ifdef BENCH
+#include "bench.c"
+#endif
+
+//
+// Program entry point.
+//
+
+int main(int argument_count, char ** arguments)
+{
+    // Use unbuffered logging.
+    setbuf(stdout, 0);
+
+    //
+    // Read the command line options.
+    //
+    // --pace chooses how frames are paced (vsync, target or adaptive), and
+    // --fps sets the frame rate for the target and adaptive modes (vsync uses
+    // the display's refresh rate, if it is known). --input
+    // chooses where button presses are read from (sdl or evdev). --record
+    // writes a log of the game to a file, and --replay plays one back without
+    // a window. --platform headless runs the game without a display for
+    // --frames frames or --seconds seconds of play (ten seconds by default) at
+    // the --fps rate, and --dump-frames writes each frame to a directory.
+    // With PROFILE, --trace writes the timing zones to a Chrome trace file when
+    // the game ends (and is where F2 writes to). Anything else is ignored.
+    //
+
+    Pace_Mode pace_mode = PACE_ADAPTIVE;
+    int frames_per_second = PACE_DEFAULT_RATE;
+    Input_Backend input_backend = INPUT_BACKEND_SDL;
+    char * record_file_name = NULL;
+    char * replay_file_name = NULL;
+    Platform platform = PLATFORM_SDL;
+    u64 headless_frame_count = 0;
+    f64 headless_seconds = 10.0;
+    char * dump_directory = NULL;
+    for (int i = 1; i < argument_count; ++i)
+    {
+        if (strcmp(arguments[i], "--pace") == 0 && i + 1 < argument_count)
+        {
+            pace_mode = find_pace_mode(arguments[++i]);
+        }
+        else if (strcmp(arguments[i], "--fps") == 0 && i + 1 < argument_count)
+        {
+            frames_per_second = atoi(arguments[++i]);
+        }
+        else if (strcmp(arguments[i], "--input") == 0 && i + 1 < argument_count)
+        {
+            input_backend = find_input_backend(arguments[++i]);
+            if (input_backend == INPUT_BACKEND_COUNT)
+            {
+                panic_exit("Unknown input backend: %s", arguments[i]);
+            }
+        }
+        else if (strcmp(arguments[i], "--record") == 0 && i + 1 < argument_count)
+        {
+            record_file_name = arguments[++i];
+        }
+        else if (strcmp(arguments[i], "--replay") == 0 && i + 1 < argument_count)
+        {
+            replay_file_name = arguments[++i];
+        }
+        else if (strcmp(arguments[i], "--platform") == 0 && i + 1 < argument_count)
+        {
+            platform = find_platform(arguments[++i]);
+            if (platform == PLATFORM_COUNT)
+            {
+                panic_exit("Unknown platform: %s", arguments[i]);
+            }
+        }
+        else if (strcmp(arguments[i], "--frames") == 0 && i + 1 < argument_count)
+        {
+            headless_frame_count = strtoull(arguments[++i], NULL, 10);
+        }
+        else if (strcmp(arguments[i], "--seconds") == 0 && i + 1 < argument_count)
+        {
+            headless_seconds = atof(arguments[++i]);
+        }
+        else if (strcmp(arguments[i], "--dump-frames") == 0 && i + 1 < argument_count)
+        {
+            dump_directory = arguments[++i];
+        }
+#ifdef PROFILE
+        else if (strcmp(arguments[i], "--trace") == 0 && i + 1 < argument_count)
+        {
+            profile_trace_file_name = arguments[++i];
+        }
+#endif
+    }
+
+    // Replays and benchmarks always run without a display.
+    if (replay_file_name) platform = PLATFORM_HEADLESS;
+#ifdef BENCH
+    platform = PLATFORM_HEADLESS;
+#endif
+    bool headless = platform == PLATFORM_HEADLESS;
+    if (headless && frames_per_second <= 0)
+    {
+        panic_exit("The frame rate must be above zero.");
+    }
+    if (!headless_frame_count)
+    {
+        headless_frame_count = headless_seconds * frames_per_second;
+    }
+
+    //
+    // Initialisation.
+    //
+
+    if (!init_memory_pools(POOL_STATIC_PERSIST_BYTE_COUNT, megabytes(8), megabytes(4)))
+    {
+        panic_exit("Could not initialise memory pools.");
+    }
+
+    if (!init_thread_pools(SDL_GetCPUCount(), THREAD_POOL_BYTE_COUNT))
+    {
+        panic_exit("Could not initialise thread memory pools.");
+    }
+
+#ifdef PROFILE
+    if (!init_profiler(PERSIST_POOL))
+    {
+        panic_exit("Could not allocate the profiler's event rings.");
+    }
+#endif
+
+    if (SDL_Init(headless ? 0 : SDL_INIT_EVERYTHING) != 0)
+    {
+        panic_exit("Could not initialise SDL2.\n%s", SDL_GetError());
+    }
+
+    //
+    // Init graphics.
+    //
+
+    if (!headless) init_display(pace_mode == PACE_VSYNC);
+
+    pixels = pool_alloc(PERSIST_POOL, WIDTH * HEIGHT * sizeof(u32));
+    set_memory(pixels, WIDTH * HEIGHT * sizeof(u32), 0);
+
+    //
+    // Init audio.
+    //
+
+    mixer = create_mixer(PERSIST_POOL, 64, 1.0);
+
+    if (!headless) open_audio_device();
 
     //
-    // Set up the timers.
+    // Set up the rewind snapshots.
     //
 
-    u64 previous_counter_ticks = SDL_GetPerformanceCounter();
-    f32 counter_ticks_per_second = SDL_GetPerformanceFrequency();
+    if (!init_snapshots(PERSIST_POOL, SNAPSHOT_COUNT, megabytes(1)))
+    {
+        panic_exit("Could not allocate the rewind snapshots.");
+    }
 
     //
     // Load assets.
@@ -142,112 +696,137 @@ int main(int argument_count, char ** arguments)
         panic_exit("Could not load all assets.\n%s", strerror(errno));
     }
 
+#ifdef DEBUG
+    print_asset_load_times();
+#endif
+
+#ifdef BENCH
+    return run_bench(headless_frame_count, frames_per_second,
+        argument_count, arguments);
+#endif
+
+    //
+    // Play back a replay log.
+    //
+
+    if (replay_file_name)
+    {
+        if (!start_replay(replay_file_name))
+        {
+            panic_exit("Could not read the replay log %s.", replay_file_name);
+        }
+        start_game();
+        int exit_code = run_replay();
+#ifdef PROFILE
+        if (profile_trace_file_name) save_profile_trace();
+#endif
+        return exit_code;
+    }
+
+    //
+    // Run without a display.
+    //
+
+    if (headless)
+    {
+        start_game_clock();
+        if (record_file_name && !start_recording(record_file_name))
+        {
+            panic_exit("Could not write the replay log %s.", record_file_name);
+        }
+        start_game();
+        int exit_code = run_headless(headless_frame_count, frames_per_second,
+            dump_directory);
+#ifdef PROFILE
+        if (profile_trace_file_name) save_profile_trace();
+#endif
+        return exit_code;
+    }
+
+#ifdef HOT_RELOAD
+    if (!start_hot_reload(HOT_RELOAD_RESERVE_BYTE_COUNT))
+    {
+        issue_warning("Could not start hot reloading of assets.");
+    }
+#endif
+
     //
     // Initialise any connected input devices.
     //
 
-    for (int i = 0; i < SDL_NumJoysticks(); ++i) {
-        SDL_JoystickOpen(i);
+    for (int i = 0; i < SDL_NumJoysticks(); ++i)
+    {
+        add_input_joystick(i);
+    }
+
+    if (!start_input(input_backend))
+    {
+        panic_exit("Could not start the input thread.\n%s", SDL_GetError());
     }
 
     //
     // Start the game.
     //
 
-    blank_cut(3.0, 0, &heart_scene, NULL);
-    play_sound(&mixer, assets.clock_sound, 1.0, 1.0, true);
+    start_game_clock();
+    if (record_file_name && !start_recording(record_file_name))
+    {
+        panic_exit("Could not write the replay log %s.", record_file_name);
+    }
+
+    start_game();
+
+    if (pace_mode == PACE_VSYNC)
+    {
+        SDL_DisplayMode display_mode;
+        if (SDL_GetCurrentDisplayMode(SDL_GetWindowDisplayIndex(window), &display_mode) == 0 &&
+            display_mode.refresh_rate > 0)
+        {
+            frames_per_second = display_mode.refresh_rate;
+        }
+    }
+    if (!init_pacer(PERSIST_POOL, pace_mode, frames_per_second, handle_events))
+    {
+        panic_exit("Could not set up frame pacing (check --pace and --fps).");
+    }
 
     while (true)
     {
-        // Update timers.
-        f32 delta_time = (SDL_GetPerformanceCounter() - previous_counter_ticks)
-                            / counter_ticks_per_second;
-        previous_counter_ticks = SDL_GetPerformanceCounter();
+        mark_profile_frame();
 
         // Handle events since last frame.
-        SDL_Event event;
-        while (SDL_PollEvent(&event))
         {
-            if (event.type == SDL_QUIT)
-            {
-#ifdef DEBUG
-                print_memory_stats();
-#endif
-                exit(0);
-            }
-            else if (event.type == SDL_KEYDOWN || event.type == SDL_KEYUP)
-            {
-                if (!event.key.repeat)
-                {
-                    SDL_Scancode sc = event.key.keysym.scancode;
-                    if (sc == SDL_SCANCODE_LSHIFT)
-                    {
-                        current_scene.input(current_scene.state, 0,
-                            event.key.state, event.key.timestamp);
-                    }
-                    else if (sc == SDL_SCANCODE_RSHIFT)
-                    {
-                        current_scene.input(current_scene.state, 1,
-                            event.key.state, event.key.timestamp);
-                    }
-
-                    // DEBUG:
-                    if (event.key.state)
-                    {
-                        if (sc == SDL_SCANCODE_1)
-                        {
-                            set_scene(heart_scene);
-                        }
-                        else if (sc == SDL_SCANCODE_2)
-                        {
-                            set_scene(lungs_scene);
-                        }
-                        else if (sc == SDL_SCANCODE_3)
-                        {
-                            set_scene(digestion_scene);
-                        }
-                        else if (sc == SDL_SCANCODE_I)
-                        {
-                            if (event.key.state)
-                            {
-                                heart_state.draw_interface = !heart_state.draw_interface;
-                                lungs_state.draw_interface = !lungs_state.draw_interface;
-                                digestion_state.draw_interface = !digestion_state.draw_interface;
-                            }
-                        }
-                        else if (sc == SDL_SCANCODE_O)
-                        {
-                            if (event.key.state)
-                            {
-                                heart_state.target_beats_per_minute += 10;
-                            }
-                        }
-                    }
-                }
-            }
-            else if (event.type == SDL_JOYBUTTONDOWN || event.type == SDL_JOYBUTTONUP)
-            {
-                current_scene.input(current_scene.state, event.jbutton.which & 1,
-                    event.jbutton.state, event.jbutton.timestamp);
-            }
-            else if (event.type == SDL_JOYDEVICEADDED)
-            {
-                SDL_JoystickOpen(event.jdevice.which);
-            }
+            PROFILE_ZONE("handle_events");
+            handle_events();
         }
 
-        // Render the scene.
-        current_scene.frame(current_scene.state, delta_time);
+        // Sample the clock for this frame.
+        step_game_clock();
+        record_frame();
 
-#ifdef DEBUG
-        draw_text(assets.main_font, 270, 226, ~0,
-            "FPS: %.0f", 1.0f / delta_time);
-#endif
+        run_frame();
 
         // Render the internal pixel buffer to the screen.
+        u32 * shown_pixels = pixels;
+#ifdef PROFILE
+        shown_pixels = draw_profile_overlay();
+#endif
         SDL_RenderClear(renderer);
-        SDL_UpdateTexture(screen_texture, NULL, pixels, WIDTH * sizeof(pixels[0]));
-        SDL_RenderCopy(renderer, screen_texture, NULL, NULL);
-        SDL_RenderPresent(renderer);
+        {
+            PROFILE_ZONE("update_texture");
+            SDL_UpdateTexture(screen_texture, NULL, shown_pixels, WIDTH * sizeof(pixels[0]));
+        }
+        {
+            PROFILE_ZONE("present");
+            SDL_RenderCopy(renderer, screen_texture, NULL, NULL);
+            end_paced_frame(pixels);
+            SDL_RenderPresent(renderer);
+        }
+
+        // Sleep until the next frame is due.
+        {
+            PROFILE_ZONE("wait");
+            wait_for_next_frame();
+        }
     }
 }
@@ -92,6 +92,12 @@ bool equal(void * a, void * b, u64 byte_count)
 // All allocations are guaranteed to be aligned to the multiple for the largest
 // type available on the machine.
 //
+// A pool can be marked as shared, in which case allocations from it are made
+// with an atomic bump of its fill count, so that worker threads may allocate
+// from it at the same time as the main thread. Each worker thread can also
+// have a private scratch pool of its own (see THREAD_POOL below), which needs
+// no synchronisation at all.
+//
 
 typedef struct
 {
@@ -99,25 +105,56 @@ typedef struct
     u64 bytes_available;
     u64 bytes_filled;
     u64 byte_count_of_last_alloc;
+    bool shared;
 } Memory_Pool;
 
 #define PERSIST_POOL 0
 #define SCENE_POOL 1
 #define FRAME_POOL 2
 
-Memory_Pool memory_pools[] = {
+// Per-thread scratch pools follow the three main pools.
+#define MAX_THREAD_POOLS 8
+#define THREAD_POOL(thread_index) (FRAME_POOL + 1 + (thread_index))
+
+// A pool held in reserve for development tools, such as asset hot reloading.
+#define RESERVE_POOL THREAD_POOL(MAX_THREAD_POOLS)
+
+Memory_Pool memory_pools[RESERVE_POOL + 1] = {
     [PERSIST_POOL] = { NULL, 0, 0, 0 },
     [SCENE_POOL]   = { NULL, 0, 0, 0 },
     [FRAME_POOL]   = { NULL, 0, 0, 0 },
 };
 
+// The number of thread pools created by init_thread_pools.
+int thread_pool_count = 0;
+
+// Allocates a number of bytes from the given memory pool, using an atomic
+// compare-and-swap so that it is safe to call from any number of threads.
+// pool_unalloc cannot be used to undo an allocation made this way.
+// Returns NULL if the allocation was unsuccessful.
+void * pool_alloc_atomic(int pool_index, u64 byte_count)
+{
+    byte_count = align_byte_count(byte_count);
+    Memory_Pool * pool = &memory_pools[pool_index];
+    u64 filled = __atomic_load_n(&pool->bytes_filled, __ATOMIC_RELAXED);
+    do
+    {
+        if (filled + byte_count > pool->bytes_available) return NULL;
+    }
+    while (!__atomic_compare_exchange_n(&pool->bytes_filled,
+        &filled, filled + byte_count, true,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return pool->memory + filled;
+}
+
 // Allocates a number of bytes from the given memory pool.
 // Returns NULL if the allocation was unsuccessful.
 void * pool_alloc(int pool_index, u64 byte_count)
 {
+    Memory_Pool * pool = &memory_pools[pool_index];
+    if (pool->shared) return pool_alloc_atomic(pool_index, byte_count);
     void * result = NULL;
     byte_count = align_byte_count(byte_count);
-    Memory_Pool * pool = &memory_pools[pool_index];
     if (pool->bytes_filled + byte_count <= pool->bytes_available)
     {
         result = pool->memory + pool->bytes_filled;
@@ -136,6 +173,13 @@ void pool_unalloc(int pool_index)
     pool->byte_count_of_last_alloc = 0;
 }
 
+// Mark a pool as being allocated from by more than one thread (or not).
+// Should be set before any other threads start to use the pool.
+void share_pool(int pool_index, bool shared)
+{
+    __atomic_store_n(&memory_pools[pool_index].shared, shared, __ATOMIC_SEQ_CST);
+}
+
 void flush_pool(int pool_index)
 {
     memory_pools[pool_index].bytes_filled = 0;
@@ -216,6 +260,40 @@ bool init_memory_pools(u64 persist_byte_count,
     return true;
 }
 
+// Carves a scratch pool for each of thread_count threads out of the persistent
+// pool. A thread should only ever allocate from its own pool, given by
+// THREAD_POOL(thread_index), and may flush it whenever its work is done. The
+// size is up to the caller, and is taken from the persistent pool's budget.
+// Returns false if the pools could not be allocated.
+bool init_thread_pools(int thread_count, u64 byte_count_per_thread)
+{
+    thread_count = min(thread_count, MAX_THREAD_POOLS);
+    for (int i = 0; i < thread_count; ++i)
+    {
+        Memory_Pool * pool = &memory_pools[THREAD_POOL(i)];
+        pool->memory = pool_alloc(PERSIST_POOL, byte_count_per_thread);
+        if (!pool->memory) return false;
+        pool->bytes_available = byte_count_per_thread;
+        pool->bytes_filled = 0;
+        pool->byte_count_of_last_alloc = 0;
+    }
+    thread_pool_count = thread_count;
+    return true;
+}
+
+// Carves the reserve pool out of the persistent pool.
+// Returns false if the pool could not be allocated.
+bool init_reserve_pool(u64 byte_count)
+{
+    Memory_Pool * pool = &memory_pools[RESERVE_POOL];
+    pool->memory = pool_alloc(PERSIST_POOL, byte_count);
+    if (!pool->memory) return false;
+    pool->bytes_available = byte_count;
+    pool->bytes_filled = 0;
+    pool->byte_count_of_last_alloc = 0;
+    return true;
+}
+
 //
 // DEBUG:
 //
@@ -225,23 +303,43 @@ void print_memory_stats()
     printf("Memory Pool Stats:\n");
 
     printf("Persist: %8llu / %8llu (%02.0f%%), %8llu\n",
-        memory_pools[PERSIST_POOL].bytes_filled,
-        memory_pools[PERSIST_POOL].bytes_available,
+        (unsigned long long)memory_pools[PERSIST_POOL].bytes_filled,
+        (unsigned long long)memory_pools[PERSIST_POOL].bytes_available,
         memory_pools[PERSIST_POOL].bytes_filled /
             (f32)memory_pools[PERSIST_POOL].bytes_available * 100,
-        memory_pools[PERSIST_POOL].byte_count_of_last_alloc);
+        (unsigned long long)memory_pools[PERSIST_POOL].byte_count_of_last_alloc);
 
     printf("Scene:   %8llu / %8llu (%02.0f%%), %8llu\n",
-        memory_pools[SCENE_POOL].bytes_filled,
-        memory_pools[SCENE_POOL].bytes_available,
+        (unsigned long long)memory_pools[SCENE_POOL].bytes_filled,
+        (unsigned long long)memory_pools[SCENE_POOL].bytes_available,
         memory_pools[SCENE_POOL].bytes_filled /
             (f32)memory_pools[SCENE_POOL].bytes_available * 100,
-        memory_pools[SCENE_POOL].byte_count_of_last_alloc);
+        (unsigned long long)memory_pools[SCENE_POOL].byte_count_of_last_alloc);
 
     printf("Frame:   %8llu / %8llu (%02.0f%%), %8llu\n",
-        memory_pools[FRAME_POOL].bytes_filled,
-        memory_pools[FRAME_POOL].bytes_available,
+        (unsigned long long)memory_pools[FRAME_POOL].bytes_filled,
+        (unsigned long long)memory_pools[FRAME_POOL].bytes_available,
         memory_pools[FRAME_POOL].bytes_filled /
             (f32)memory_pools[FRAME_POOL].bytes_available * 100,
-        memory_pools[FRAME_POOL].byte_count_of_last_alloc);
+        (unsigned long long)memory_pools[FRAME_POOL].byte_count_of_last_alloc);
+
+    if (memory_pools[RESERVE_POOL].memory)
+    {
+        Memory_Pool * pool = &memory_pools[RESERVE_POOL];
+        printf("Reserve: %8llu / %8llu (%02.0f%%), %8llu\n",
+            (unsigned long long)pool->bytes_filled,
+            (unsigned long long)pool->bytes_available,
+            pool->bytes_filled / (f32)pool->bytes_available * 100,
+            (unsigned long long)pool->byte_count_of_last_alloc);
+    }
+
+    for (int i = 0; i < thread_pool_count; ++i)
+    {
+        Memory_Pool * pool = &memory_pools[THREAD_POOL(i)];
+        printf("Thread %d: %7llu / %8llu (%02.0f%%), %8llu\n", i,
+            (unsigned long long)pool->bytes_filled,
+            (unsigned long long)pool->bytes_available,
+            pool->bytes_filled / (f32)pool->bytes_available * 100,
+            (unsigned long long)pool->byte_count_of_last_alloc);
+    }
 }
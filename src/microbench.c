@@ -0,0 +1,465 @@
+//
+// microbench.c
+//
+// This file contains:
+//     - Program entry point for the microbenchmarks.
+//     - Test data set-up.
+//     - Benchmarked calls.
+//     - Timing and statistics.
+//
+// The microbenchmarks are a separate program, built from the same sources as
+// the game. Each one calls a single drawing, audio or random function over and
+// over on made-up data, and reports how much it gets through per second: in
+// pixels, samples or calls. Where the scene benchmarks (see
+// bench.c) show that a frame has got slower, these show which function did,
+// and whether a change to one of them made it any faster.
+//
+// Each benchmark is first run for longer and longer until one run takes at
+// least --min-ms (20 by default), which also warms the caches and branch
+// predictors. That many calls are then timed --repetitions times (20 by
+// default), and the mean rate is given with a 95% confidence interval. Only
+// the benchmarks with a name containing --filter are run.
+//
+
+// Compile time options for the memory allocator.
+#define POOL_STATIC_ALLOCATE
+#define POOL_STATIC_PERSIST_BYTE_COUNT (16 * 1000 * 1000)
+
+// External includes here:
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#include <SDL2/SDL.h>
+
+#include "common.c"
+#include "memory.c"
+#include "profile.c"
+#include "compress.c"
+#include "graphics.c"
+#include "audio.c"
+#include "assets.c"
+
+#define MICROBENCH_DEFAULT_REPETITIONS 20
+#define MICROBENCH_MAX_REPETITIONS 1000
+#define MICROBENCH_DEFAULT_MIN_MS 20
+#define MICROBENCH_IMAGE_SIZE 64
+#define MICROBENCH_SOUND_SAMPLE_COUNT (48000 * 4)
+#define MICROBENCH_MIX_FRAME_COUNT 512
+#define MICROBENCH_MAX_VOICES 512
+
+//
+// Test data set-up.
+//
+
+struct
+{
+    Image opaque_image;
+    Image alpha_image;
+    Image indexed_image;
+    Font font;
+    u32 * convert_pixels;
+    Sound sound;
+    f32 * mix_samples;
+}
+test_data;
+
+// A made-up font, with each glyph about half filled.
+Font make_test_font(int pool_index)
+{
+    Font font = { NULL, 8, 10 };
+    int pixel_count = 95 * font.char_width * font.char_height;
+    font.pixels = pool_alloc(pool_index, pixel_count * sizeof(u32));
+    for (int i = 0; i < pixel_count; ++i)
+    {
+        font.pixels[i] = chance(0.5) ? ~0 : 0;
+    }
+    return font;
+}
+
+// Make an image the size of a typical sprite. An alpha_chance of 1.0 makes it
+// fully opaque.
+Image make_test_image(int pool_index, f32 alpha_chance)
+{
+    int pixel_count = MICROBENCH_IMAGE_SIZE * MICROBENCH_IMAGE_SIZE;
+    Image image = { NULL, MICROBENCH_IMAGE_SIZE, MICROBENCH_IMAGE_SIZE };
+    image.pixels = pool_alloc(pool_index, pixel_count * sizeof(u32));
+    for (int i = 0; i < pixel_count; ++i)
+    {
+        u8 alpha = chance(alpha_chance) ? 255 : 0;
+        image.pixels[i] = rgba(random_int_range(0, 255), random_int_range(0, 255),
+            random_int_range(0, 255), alpha);
+    }
+    return image;
+}
+
+// Make a palette-indexed image, as the cooker stores them, where index 0 is
+// transparent.
+Image make_test_indexed_image(int pool_index)
+{
+    int pixel_count = MICROBENCH_IMAGE_SIZE * MICROBENCH_IMAGE_SIZE;
+    Image image = { NULL, MICROBENCH_IMAGE_SIZE, MICROBENCH_IMAGE_SIZE };
+    image.indices = pool_alloc(pool_index, pixel_count);
+    image.palette = pool_alloc(pool_index, 256 * sizeof(u32));
+    for (int i = 0; i < 256; ++i)
+    {
+        image.palette[i] = rgba(i, 255 - i, i / 2, i ? 255 : 0);
+    }
+    for (int i = 0; i < pixel_count; ++i)
+    {
+        image.indices[i] = random_int_range(0, 15);
+    }
+    return image;
+}
+
+// Returns false if there was not enough memory.
+bool make_test_data(int pool_index)
+{
+    set_seed(1, 2);
+    pixels = pool_alloc(pool_index, WIDTH * HEIGHT * sizeof(u32));
+    test_data.opaque_image = make_test_image(pool_index, 1.0);
+    test_data.alpha_image = make_test_image(pool_index, 0.5);
+    test_data.indexed_image = make_test_indexed_image(pool_index);
+    test_data.font = make_test_font(pool_index);
+    test_data.convert_pixels = pool_alloc(pool_index, WIDTH * HEIGHT * sizeof(u32));
+    test_data.sound.sample_count = MICROBENCH_SOUND_SAMPLE_COUNT;
+    test_data.sound.samples = pool_alloc(pool_index,
+        MICROBENCH_SOUND_SAMPLE_COUNT * sizeof(f32));
+    test_data.mix_samples = pool_alloc(pool_index,
+        MICROBENCH_MIX_FRAME_COUNT * 2 * sizeof(f32));
+    mixer = create_mixer(pool_index, MICROBENCH_MAX_VOICES, 1.0);
+    if (!pixels || !test_data.opaque_image.pixels || !test_data.alpha_image.pixels ||
+        !test_data.indexed_image.indices || !test_data.indexed_image.palette ||
+        !test_data.font.pixels || !test_data.convert_pixels ||
+        !test_data.sound.samples || !test_data.mix_samples || !mixer.channels)
+    {
+        return false;
+    }
+    for (int i = 0; i < MICROBENCH_SOUND_SAMPLE_COUNT; ++i)
+    {
+        test_data.sound.samples[i] = random_f32_range(-1.0, 1.0);
+    }
+    return true;
+}
+
+// Start voice_count looping sounds, each at a different point.
+void set_up_voices(int voice_count)
+{
+    set_memory(mixer.channels, mixer.channel_count * sizeof(Mixer_Channel), 0);
+    for (int i = 0; i < voice_count; ++i)
+    {
+        int channel = play_sound(&mixer, test_data.sound, 0.5, 0.5, true);
+        mixer.channels[channel].sample_index =
+            random_int_range(0, MICROBENCH_SOUND_SAMPLE_COUNT - 1);
+    }
+}
+
+//
+// Benchmarked calls.
+//
+// Each of these makes call_count calls of the function being measured. The
+// results of functions that only return something are added to a volatile
+// sink, so that the calls are not optimised away.
+//
+
+volatile u64 microbench_sink;
+
+void bench_clear(int parameter, u64 call_count)
+{
+    for (u64 i = 0; i < call_count; ++i) clear(i);
+}
+
+void bench_draw_noise(int parameter, u64 call_count)
+{
+    for (u64 i = 0; i < call_count; ++i) draw_noise(0.5);
+}
+
+// A diagonal from one side of the screen to the other, at a different height
+// each time, so that every line is WIDTH pixels long.
+void bench_draw_line(int parameter, u64 call_count)
+{
+    for (u64 i = 0; i < call_count; ++i)
+    {
+        int y = i % HEIGHT;
+        draw_line(0, y, WIDTH - 1, HEIGHT - 1 - y, ~0);
+    }
+}
+
+void bench_draw_image_opaque(int parameter, u64 call_count)
+{
+    for (u64 i = 0; i < call_count; ++i)
+    {
+        draw_image(test_data.opaque_image, 100 + (i & 7), 80);
+    }
+}
+
+void bench_draw_image_alpha(int parameter, u64 call_count)
+{
+    for (u64 i = 0; i < call_count; ++i)
+    {
+        draw_image(test_data.alpha_image, 100 + (i & 7), 80);
+    }
+}
+
+void bench_draw_image_indexed(int parameter, u64 call_count)
+{
+    for (u64 i = 0; i < call_count; ++i)
+    {
+        draw_image(test_data.indexed_image, 100 + (i & 7), 80);
+    }
+}
+
+// Half off the left and top of the screen, so a quarter is drawn.
+void bench_draw_image_clipped(int parameter, u64 call_count)
+{
+    for (u64 i = 0; i < call_count; ++i)
+    {
+        draw_image(test_data.alpha_image,
+            -MICROBENCH_IMAGE_SIZE / 2, -MICROBENCH_IMAGE_SIZE / 2);
+    }
+}
+
+// parameter is the number of characters.
+void bench_draw_text(int parameter, u64 call_count)
+{
+    char text[] = "The quick brown fox jumps over the lazy dog.";
+    text[parameter] = 0;
+    for (u64 i = 0; i < call_count; ++i)
+    {
+        draw_text(test_data.font, 10, 100, ~0, "%s", text);
+    }
+}
+
+void bench_agbr_to_rgba(int parameter, u64 call_count)
+{
+    for (u64 i = 0; i < call_count; ++i)
+    {
+        agbr_to_rgba(test_data.convert_pixels, WIDTH * HEIGHT);
+    }
+}
+
+// parameter is the number of voices, which were started by set_up_voices.
+void bench_mix_audio(int parameter, u64 call_count)
+{
+    for (u64 i = 0; i < call_count; ++i)
+    {
+        mix_audio(&mixer, test_data.mix_samples, MICROBENCH_MIX_FRAME_COUNT * 2);
+    }
+}
+
+void bench_random_u64(int parameter, u64 call_count)
+{
+    u64 sum = 0;
+    for (u64 i = 0; i < call_count; ++i) sum += random_u64();
+    microbench_sink += sum;
+}
+
+void bench_random_f32(int parameter, u64 call_count)
+{
+    f32 sum = 0;
+    for (u64 i = 0; i < call_count; ++i) sum += random_f32();
+    microbench_sink += sum;
+}
+
+void bench_random_int_range(int parameter, u64 call_count)
+{
+    u64 sum = 0;
+    for (u64 i = 0; i < call_count; ++i) sum += random_int_range(0, 255);
+    microbench_sink += sum;
+}
+
+void bench_chance(int parameter, u64 call_count)
+{
+    u64 sum = 0;
+    for (u64 i = 0; i < call_count; ++i) sum += chance(0.5);
+    microbench_sink += sum;
+}
+
+typedef void (* Bench_Func)(int parameter, u64 call_count);
+
+typedef struct
+{
+    char * name;
+    Bench_Func run;
+    int parameter;
+    // How much work each call does, and what it is counted in.
+    f64 units_per_call;
+    char * unit;
+}
+Microbenchmark;
+
+#define IMAGE_PIXELS (MICROBENCH_IMAGE_SIZE * MICROBENCH_IMAGE_SIZE)
+// Text is counted in the pixels of each whole character cell.
+#define FONT_PIXELS (8 * 10)
+
+Microbenchmark microbenchmarks[] =
+{
+    { "clear", bench_clear, 0, WIDTH * HEIGHT, "pixels" },
+    { "draw_noise", bench_draw_noise, 0, WIDTH * HEIGHT, "pixels" },
+    { "draw_line", bench_draw_line, 0, WIDTH, "pixels" },
+    { "draw_image/opaque", bench_draw_image_opaque, 0, IMAGE_PIXELS, "pixels" },
+    { "draw_image/alpha", bench_draw_image_alpha, 0, IMAGE_PIXELS, "pixels" },
+    { "draw_image/indexed", bench_draw_image_indexed, 0, IMAGE_PIXELS, "pixels" },
+    { "draw_image/clipped", bench_draw_image_clipped, 0, IMAGE_PIXELS / 4, "pixels" },
+    { "draw_text/8", bench_draw_text, 8, 8 * FONT_PIXELS, "pixels" },
+    { "draw_text/32", bench_draw_text, 32, 32 * FONT_PIXELS, "pixels" },
+    { "agbr_to_rgba", bench_agbr_to_rgba, 0, WIDTH * HEIGHT, "pixels" },
+    // Counted in samples of each voice, so that the rates are comparable.
+    { "mix_audio/1", bench_mix_audio, 1, MICROBENCH_MIX_FRAME_COUNT * 1, "samples" },
+    { "mix_audio/8", bench_mix_audio, 8, MICROBENCH_MIX_FRAME_COUNT * 8, "samples" },
+    { "mix_audio/64", bench_mix_audio, 64, MICROBENCH_MIX_FRAME_COUNT * 64, "samples" },
+    { "mix_audio/512", bench_mix_audio, 512, MICROBENCH_MIX_FRAME_COUNT * 512, "samples" },
+    { "random_u64", bench_random_u64, 0, 1, "calls" },
+    { "random_f32", bench_random_f32, 0, 1, "calls" },
+    { "random_int_range", bench_random_int_range, 0, 1, "calls" },
+    { "chance", bench_chance, 0, 1, "calls" },
+};
+
+#define MICROBENCHMARK_COUNT (sizeof(microbenchmarks) / sizeof(microbenchmarks[0]))
+
+//
+// Timing and statistics.
+//
+
+// Two-sided 95% critical values of Student's t distribution, by degrees of
+// freedom. Past the end of the table the normal distribution is close enough.
+f64 t_critical_values[] =
+{
+    0.0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262,
+    2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093,
+    2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045,
+    2.042,
+};
+
+f64 get_t_critical_value(int degrees_of_freedom)
+{
+    int count = sizeof(t_critical_values) / sizeof(t_critical_values[0]);
+    return degrees_of_freedom < count ? t_critical_values[degrees_of_freedom] : 1.960;
+}
+
+// Returns the time taken in nanoseconds.
+u64 time_bench_calls(Microbenchmark * bench, u64 call_count)
+{
+    u64 start_ns = get_time_ns();
+    bench->run(bench->parameter, call_count);
+    return get_time_ns() - start_ns;
+}
+
+// Print a rate with an SI prefix.
+void print_rate(f64 rate, char * unit)
+{
+    char * prefixes[] = { "", "k", "M", "G", "T" };
+    int prefix = 0;
+    while (rate >= 1000.0 && prefix < 4)
+    {
+        rate /= 1000.0;
+        ++prefix;
+    }
+    printf("%8.2f %s%s/s", rate, prefixes[prefix], unit);
+}
+
+void run_microbenchmark(Microbenchmark * bench, int repetition_count, u64 min_ns)
+{
+    if (bench->run == bench_mix_audio) set_up_voices(bench->parameter);
+
+    // Warm up, while finding how many calls take long enough to time.
+    u64 call_count = 1;
+    while (time_bench_calls(bench, call_count) < min_ns)
+    {
+        call_count *= 2;
+    }
+
+    f64 rates[MICROBENCH_MAX_REPETITIONS];
+    f64 sum = 0.0;
+    for (int i = 0; i < repetition_count; ++i)
+    {
+        u64 elapsed_ns = time_bench_calls(bench, call_count);
+        rates[i] = bench->units_per_call * call_count * 1000000000.0 / max(elapsed_ns, 1);
+        sum += rates[i];
+    }
+    f64 mean = sum / repetition_count;
+    f64 squared_difference_sum = 0.0;
+    for (int i = 0; i < repetition_count; ++i)
+    {
+        squared_difference_sum += (rates[i] - mean) * (rates[i] - mean);
+    }
+    f64 interval = 0.0;
+    if (repetition_count > 1)
+    {
+        f64 standard_deviation = sqrt(squared_difference_sum / (repetition_count - 1));
+        interval = get_t_critical_value(repetition_count - 1) *
+            standard_deviation / sqrt(repetition_count);
+    }
+
+    printf("%-20s ", bench->name);
+    print_rate(mean, bench->unit);
+    printf("  +/- %5.2f%%  (%llu calls x %d)\n",
+        mean > 0.0 ? interval / mean * 100.0 : 0.0, (unsigned long long)call_count,
+        repetition_count);
+}
+
+//
+// Program entry point.
+//
+
+int main(int argument_count, char ** arguments)
+{
+    setbuf(stdout, 0);
+
+    int repetition_count = MICROBENCH_DEFAULT_REPETITIONS;
+    u64 min_ms = MICROBENCH_DEFAULT_MIN_MS;
+    char * filter = "";
+    for (int i = 1; i < argument_count; ++i)
+    {
+        if (strcmp(arguments[i], "--repetitions") == 0 && i + 1 < argument_count)
+        {
+            repetition_count = atoi(arguments[++i]);
+        }
+        else if (strcmp(arguments[i], "--min-ms") == 0 && i + 1 < argument_count)
+        {
+            min_ms = strtoull(arguments[++i], NULL, 10);
+        }
+        else if (strcmp(arguments[i], "--filter") == 0 && i + 1 < argument_count)
+        {
+            filter = arguments[++i];
+        }
+    }
+    if (repetition_count < 1 || repetition_count > MICROBENCH_MAX_REPETITIONS)
+    {
+        panic_exit("--repetitions must be from 1 to %d.", MICROBENCH_MAX_REPETITIONS);
+    }
+
+    if (!init_memory_pools(megabytes(16), megabytes(1), megabytes(1)))
+    {
+        panic_exit("Could not initialise memory pools.");
+    }
+
+    if (!make_test_data(PERSIST_POOL))
+    {
+        panic_exit("Could not allocate the test data.");
+    }
+
+    printf("Microbenchmarks (95%% confidence intervals):\n");
+    for (int i = 0; i < MICROBENCHMARK_COUNT; ++i)
+    {
+        if (strstr(microbenchmarks[i].name, filter))
+        {
+            run_microbenchmark(&microbenchmarks[i], repetition_count,
+                min_ms * 1000000);
+        }
+    }
+    return 0;
+}
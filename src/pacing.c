@@ -0,0 +1,247 @@
+//
+// pacing.c
+//
+// This file contains:
+//     - Frame pacing.
+//
+
+//
+// Frame pacing.
+//
+// Without pacing, the frame loop would redraw the same picture thousands of
+// times a second and keep a core busy doing it. The pacer decides when the
+// next frame starts, in one of three ways:
+//
+//     - PACE_VSYNC leaves it to the renderer, which blocks in
+//       SDL_RenderPresent until the display is ready. After that, the pacer
+//       waits for most of the refresh, and starts the next frame just soon
+//       enough for it to be made before the following one. How soon that is
+//       follows how long recent frames have taken, plus PACE_VSYNC_MARGIN_NS.
+//     - PACE_TARGET runs at a fixed rate. The wait is mostly spent asleep,
+//       and the last part is spun, because sleeps often wake up late. The
+//       length of the spin follows how late recent sleeps have been.
+//     - PACE_ADAPTIVE is like PACE_TARGET, but when a frame comes out the same
+//       as the one before, the time until the next frame is doubled, up to
+//       PACE_IDLE_INTERVAL_NS. Any change or input goes straight back to the
+//       target rate.
+//
+// So that input is not held up by a long wait, the event queue is checked
+// while sleeping and any events are handled right away, in every mode. Input
+// can still wait for up to the length of a frame while one is being made. In
+// the adaptive mode an event also ends the wait, so that the response is drawn
+// straight after.
+//
+// The pacer measures how far the start of each frame is from when it was
+// meant to be. This jitter is reported by print_pacing_stats.
+//
+
+#define PACE_DEFAULT_RATE 60
+#define PACE_IDLE_INTERVAL_NS (1000000000ull / 15)
+// The longest single sleep, so that input is seen promptly while waiting.
+#define PACE_INPUT_CHECK_NS 500000ull
+#define PACE_MIN_SPIN_NS 50000ull
+#define PACE_MAX_SPIN_NS 2000000ull
+// How much sooner than needed a frame is started in the vsync mode, in case it
+// takes longer than the ones before.
+#define PACE_VSYNC_MARGIN_NS 2000000ull
+
+typedef enum
+{
+    PACE_VSYNC,
+    PACE_TARGET,
+    PACE_ADAPTIVE,
+    PACE_MODE_COUNT,
+}
+Pace_Mode;
+
+char * pace_mode_names[PACE_MODE_COUNT] =
+{
+    [PACE_VSYNC] = "vsync",
+    [PACE_TARGET] = "target",
+    [PACE_ADAPTIVE] = "adaptive",
+};
+
+typedef bool (* Event_Func)(void);
+
+struct
+{
+    Pace_Mode mode;
+    u64 target_interval_ns;
+    u64 interval_ns;
+    u64 last_frame_ns;
+    u64 spin_ns;
+    // How long recent frames have taken to make, for the vsync mode.
+    u64 work_ns;
+    // Called to handle any events that arrive while waiting. Returns true if
+    // there were some.
+    Event_Func handle_events;
+    bool event_handled;
+    // A copy of the last frame, to tell if anything has changed.
+    u32 * previous_pixels;
+
+    // Jitter statistics, in nanoseconds.
+    u64 frame_count;
+    f64 jitter_total;
+    f64 jitter_squared_total;
+    u64 jitter_max;
+    u64 idle_frame_count;
+}
+pacer;
+
+// Find a pace mode by name. Returns PACE_MODE_COUNT if there is none.
+Pace_Mode find_pace_mode(char * name)
+{
+    for (int mode = 0; mode < PACE_MODE_COUNT; ++mode)
+    {
+        if (strcmp(name, pace_mode_names[mode]) == 0) return mode;
+    }
+    return PACE_MODE_COUNT;
+}
+
+// Returns false if the pacer could not be set up.
+bool init_pacer(int pool_index, Pace_Mode mode, int frames_per_second,
+    Event_Func handle_events)
+{
+    if (mode >= PACE_MODE_COUNT || frames_per_second <= 0) return false;
+    pacer.mode = mode;
+    pacer.target_interval_ns = 1000000000ull / frames_per_second;
+    pacer.interval_ns = pacer.target_interval_ns;
+    pacer.spin_ns = PACE_MAX_SPIN_NS / 2;
+    pacer.handle_events = handle_events;
+    if (mode == PACE_ADAPTIVE)
+    {
+        pacer.previous_pixels = pool_alloc(pool_index, WIDTH * HEIGHT * sizeof(u32));
+        if (!pacer.previous_pixels) return false;
+        set_memory(pacer.previous_pixels, WIDTH * HEIGHT * sizeof(u32), 0);
+    }
+    pacer.last_frame_ns = get_time_ns();
+    return true;
+}
+
+// Handle any events that are waiting.
+// Returns true if there were some.
+static bool pacer_handle_events()
+{
+    if (!pacer.handle_events()) return false;
+    pacer.event_handled = true;
+    return true;
+}
+
+// Note that a frame has been drawn into pixels. In the adaptive mode, this
+// decides how long to wait before the next one.
+void end_paced_frame(u32 * pixels)
+{
+    if (pacer.mode == PACE_VSYNC)
+    {
+        // Follow the slowest recent frame, letting it fall off slowly.
+        u64 work_ns = get_time_ns() - pacer.last_frame_ns;
+        pacer.work_ns = max(work_ns, pacer.work_ns * 15 / 16);
+        return;
+    }
+    if (pacer.mode != PACE_ADAPTIVE) return;
+    u64 byte_count = WIDTH * HEIGHT * sizeof(u32);
+    if (!pacer.event_handled && memcmp(pixels, pacer.previous_pixels, byte_count) == 0)
+    {
+        pacer.interval_ns = min(pacer.interval_ns * 2, PACE_IDLE_INTERVAL_NS);
+        ++pacer.idle_frame_count;
+    }
+    else
+    {
+        pacer.interval_ns = pacer.target_interval_ns;
+        memcpy(pacer.previous_pixels, pixels, byte_count);
+    }
+    pacer.event_handled = false;
+}
+
+static void note_frame_jitter(u64 jitter_ns)
+{
+    ++pacer.frame_count;
+    pacer.jitter_total += jitter_ns;
+    pacer.jitter_squared_total += (f64)jitter_ns * jitter_ns;
+    pacer.jitter_max = max(pacer.jitter_max, jitter_ns);
+}
+
+// In the vsync mode, this is called just after the display refreshed. Wait
+// until the next frame must be started to be ready for the refresh after,
+// handling input along the way.
+static void wait_for_vsync_frame()
+{
+    u64 now_ns = get_time_ns();
+    u64 lead_ns = min(pacer.work_ns + PACE_VSYNC_MARGIN_NS, pacer.target_interval_ns);
+    u64 frame_ns = now_ns + pacer.target_interval_ns - lead_ns;
+    while (true)
+    {
+        pacer_handle_events();
+        now_ns = get_time_ns();
+        if (now_ns >= frame_ns) break;
+        sleep_until_ns(min(frame_ns, now_ns + PACE_INPUT_CHECK_NS));
+    }
+    note_frame_jitter(now_ns - frame_ns);
+    pacer.last_frame_ns = now_ns;
+}
+
+// Wait until the next frame should start.
+void wait_for_next_frame()
+{
+    if (pacer.mode == PACE_VSYNC)
+    {
+        wait_for_vsync_frame();
+        return;
+    }
+
+    u64 frame_ns = pacer.last_frame_ns + pacer.interval_ns;
+
+    // Sleep until just before the frame, handling input along the way.
+    while (true)
+    {
+        if (pacer_handle_events() && pacer.mode == PACE_ADAPTIVE)
+        {
+            frame_ns = min(frame_ns, get_time_ns());
+            break;
+        }
+        u64 now_ns = get_time_ns();
+        if (now_ns + pacer.spin_ns >= frame_ns) break;
+        u64 wake_ns = min(frame_ns - pacer.spin_ns, now_ns + PACE_INPUT_CHECK_NS);
+        sleep_until_ns(wake_ns);
+
+        // Follow how late sleeps wake up, so that the spin is just long enough.
+        u64 woke_ns = get_time_ns();
+        u64 late_ns = woke_ns > wake_ns ? woke_ns - wake_ns : 0;
+        pacer.spin_ns = (pacer.spin_ns * 15 + clamp(PACE_MIN_SPIN_NS,
+            late_ns * 2, PACE_MAX_SPIN_NS)) / 16;
+    }
+
+    // Spin for the rest of the time.
+    u64 now_ns = get_time_ns();
+    while (now_ns < frame_ns)
+    {
+#ifdef __SSE2__
+        _mm_pause();
+#endif
+        now_ns = get_time_ns();
+    }
+
+    u64 jitter_ns = now_ns - frame_ns;
+    note_frame_jitter(jitter_ns);
+
+    // If the frame was badly late, start again from now rather than rushing
+    // to catch up.
+    pacer.last_frame_ns = jitter_ns > pacer.interval_ns ? now_ns : frame_ns;
+}
+
+void print_pacing_stats()
+{
+    printf("Frame Pacing Stats (%s):\n", pace_mode_names[pacer.mode]);
+    if (!pacer.frame_count)
+    {
+        printf("No paced frames.\n");
+        return;
+    }
+    f64 mean = pacer.jitter_total / pacer.frame_count;
+    f64 variance = pacer.jitter_squared_total / pacer.frame_count - mean * mean;
+    printf("Frames: %llu (%llu idle)\n", (unsigned long long)pacer.frame_count,
+        (unsigned long long)pacer.idle_frame_count);
+    printf("Jitter: %.1fus mean, %.1fus deviation, %.1fus max\n",
+        mean / 1000.0, sqrt(max(variance, 0.0)) / 1000.0, pacer.jitter_max / 1000.0);
+    printf("Spin:   %.1fus\n", pacer.spin_ns / 1000.0);
+}
@@ -0,0 +1,252 @@
+//
+// profile.c
+//
+// This file contains:
+//     - Timing zones.
+//     - Per-thread event rings.
+//     - Frame summaries for the profiler overlay.
+//     - Chrome trace output.
+//
+// With PROFILE defined, PROFILE_ZONE("name") times from where it is written to
+// the end of the enclosing block, however that is left. Each thread records its
+// zones into its own ring of events, allocated up front from a pool, so
+// recording needs no locks and no allocation; the oldest events are
+// overwritten. The rings can be written out as a Chrome trace (open it at
+// chrome://tracing or ui.perfetto.dev) to find what made a frame slow, and the
+// main thread's last frame can be summarised for an overlay (see main.c). The
+// bench build adds up its phases from the same zones (see bench.c).
+//
+// Reading another thread's ring while it is being written to can give a torn
+// event from the very oldest part of the ring. That is fine for a profiler.
+// Without PROFILE, zones compile to nothing.
+//
+
+#define PROFILE_MAX_THREADS 8
+// Must be a power of two.
+#define PROFILE_EVENTS_PER_THREAD 16384
+#define PROFILE_FRAME_HISTORY 64
+
+#ifdef PROFILE
+
+typedef struct
+{
+    char * name;
+    u64 start_ns;
+    u32 duration_ns;
+    // How many zones this one is inside.
+    u32 depth;
+}
+Profile_Event;
+
+typedef struct
+{
+    char * name;
+    Profile_Event * events;
+    // Only ever written by the ring's own thread.
+    u64 event_count;
+    u32 depth;
+}
+Profile_Ring;
+
+struct
+{
+    Profile_Ring rings[PROFILE_MAX_THREADS];
+    int ring_count;
+    // Given to threads once all of the rings are taken, and records nothing.
+    Profile_Ring overflow_ring;
+    u64 start_ns;
+    u64 frame_starts_ns[PROFILE_FRAME_HISTORY];
+    u64 frame_count;
+    bool show_overlay;
+}
+profiler;
+
+static _Thread_local Profile_Ring * profile_ring;
+
+typedef struct
+{
+    char * name;
+    u64 start_ns;
+}
+Profile_Zone;
+
+// The calling thread's ring, which is taken the first time it is needed.
+static inline Profile_Ring * get_profile_ring()
+{
+    if (!profile_ring)
+    {
+        int index = __atomic_fetch_add(&profiler.ring_count, 1, __ATOMIC_RELAXED);
+        profile_ring = index < PROFILE_MAX_THREADS ?
+            &profiler.rings[index] : &profiler.overflow_ring;
+    }
+    return profile_ring;
+}
+
+// Name the calling thread in traces.
+void set_profile_thread_name(char * name)
+{
+    get_profile_ring()->name = name;
+}
+
+// Call on the main thread, which is given the first ring, before any other
+// threads are started.
+// Returns false if there is not enough space in the pool.
+bool init_profiler(int pool_index)
+{
+    for (int i = 0; i < PROFILE_MAX_THREADS; ++i)
+    {
+        profiler.rings[i].name = "thread";
+        profiler.rings[i].events = pool_alloc(pool_index,
+            PROFILE_EVENTS_PER_THREAD * sizeof(Profile_Event));
+        if (!profiler.rings[i].events) return false;
+    }
+    profiler.start_ns = get_time_ns();
+    set_profile_thread_name("main");
+    return true;
+}
+
+static inline Profile_Zone begin_profile_zone(char * name)
+{
+    ++get_profile_ring()->depth;
+    return (Profile_Zone){ name, get_time_ns() };
+}
+
+static inline void end_profile_zone(Profile_Zone * zone)
+{
+    u64 end_ns = get_time_ns();
+    Profile_Ring * ring = profile_ring;
+    --ring->depth;
+    if (!ring->events) return;
+    u64 event_count = ring->event_count;
+    ring->events[event_count & (PROFILE_EVENTS_PER_THREAD - 1)] = (Profile_Event){
+        zone->name, zone->start_ns, end_ns - zone->start_ns, ring->depth };
+    __atomic_store_n(&ring->event_count, event_count + 1, __ATOMIC_RELEASE);
+}
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_ZONE(name) \
+    Profile_Zone PROFILE_CONCAT(profile_zone_, __LINE__) \
+    __attribute__((cleanup(end_profile_zone))) = begin_profile_zone(name)
+
+// Call at the start of each frame, on the main thread.
+void mark_profile_frame()
+{
+    profiler.frame_starts_ns[profiler.frame_count % PROFILE_FRAME_HISTORY] =
+        get_time_ns();
+    ++profiler.frame_count;
+}
+
+//
+// Frame summaries.
+//
+
+typedef struct
+{
+    char * name;
+    u32 depth;
+    u32 call_count;
+    u64 total_ns;
+}
+Profile_Summary_Line;
+
+// Add up the zones of a thread that started between two times, by name.
+// Returns the number of lines filled in, in the order the zones first ended.
+int summarise_profile_ring(Profile_Ring * ring, u64 from_ns, u64 to_ns,
+    Profile_Summary_Line * lines, int max_line_count)
+{
+    int line_count = 0;
+    u64 event_count = __atomic_load_n(&ring->event_count, __ATOMIC_ACQUIRE);
+    u64 first = event_count > PROFILE_EVENTS_PER_THREAD ?
+        event_count - PROFILE_EVENTS_PER_THREAD : 0;
+    for (u64 i = first; i < event_count; ++i)
+    {
+        Profile_Event event = ring->events[i & (PROFILE_EVENTS_PER_THREAD - 1)];
+        if (event.start_ns < from_ns || event.start_ns >= to_ns) continue;
+        int line = 0;
+        while (line < line_count && strcmp(lines[line].name, event.name) != 0) ++line;
+        if (line == line_count)
+        {
+            if (line_count == max_line_count) continue;
+            lines[line_count++] = (Profile_Summary_Line){ event.name, event.depth };
+        }
+        lines[line].depth = min(lines[line].depth, event.depth);
+        lines[line].call_count += 1;
+        lines[line].total_ns += event.duration_ns;
+    }
+    return line_count;
+}
+
+// Summarise the last whole frame of the main thread.
+// Returns the number of lines filled in.
+int summarise_last_profile_frame(Profile_Summary_Line * lines, int max_line_count)
+{
+    if (profiler.frame_count < 2 || !profiler.ring_count) return 0;
+    u64 from_ns = profiler.frame_starts_ns[(profiler.frame_count - 2) % PROFILE_FRAME_HISTORY];
+    u64 to_ns = profiler.frame_starts_ns[(profiler.frame_count - 1) % PROFILE_FRAME_HISTORY];
+    return summarise_profile_ring(&profiler.rings[0], from_ns, to_ns,
+        lines, max_line_count);
+}
+
+// The length of the last whole frame, and the longest of the recent ones.
+void get_profile_frame_times(u64 * last_ns, u64 * longest_ns)
+{
+    *last_ns = 0;
+    *longest_ns = 0;
+    u64 count = min(profiler.frame_count, PROFILE_FRAME_HISTORY);
+    for (u64 i = 1; i < count; ++i)
+    {
+        u64 frame = profiler.frame_count - i;
+        u64 length_ns = profiler.frame_starts_ns[frame % PROFILE_FRAME_HISTORY] -
+            profiler.frame_starts_ns[(frame - 1) % PROFILE_FRAME_HISTORY];
+        if (i == 1) *last_ns = length_ns;
+        *longest_ns = max(*longest_ns, length_ns);
+    }
+}
+
+//
+// Chrome trace output.
+//
+
+// Write every thread's ring to a file in the Chrome trace event format.
+// Returns false if the file could not be written.
+bool write_profile_trace(char * file_name)
+{
+    FILE * file = fopen(file_name, "w");
+    if (!file) return false;
+    fprintf(file, "{\"traceEvents\":[\n");
+    bool first_event = true;
+    int ring_count = min(__atomic_load_n(&profiler.ring_count, __ATOMIC_RELAXED),
+        PROFILE_MAX_THREADS);
+    for (int thread = 0; thread < ring_count; ++thread)
+    {
+        Profile_Ring * ring = &profiler.rings[thread];
+        fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+            "\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            first_event ? "" : ",\n", thread, ring->name);
+        first_event = false;
+
+        u64 event_count = __atomic_load_n(&ring->event_count, __ATOMIC_ACQUIRE);
+        u64 first = event_count > PROFILE_EVENTS_PER_THREAD ?
+            event_count - PROFILE_EVENTS_PER_THREAD : 0;
+        for (u64 i = first; i < event_count; ++i)
+        {
+            Profile_Event event = ring->events[i & (PROFILE_EVENTS_PER_THREAD - 1)];
+            if (event.start_ns < profiler.start_ns) continue;
+            fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                "\"ts\":%.3f,\"dur\":%.3f}",
+                event.name, thread, (event.start_ns - profiler.start_ns) / 1000.0,
+                event.duration_ns / 1000.0);
+        }
+    }
+    fprintf(file, "\n]}\n");
+    return fclose(file) == 0;
+}
+
+#else
+
+#define PROFILE_ZONE(name)
+#define set_profile_thread_name(name)
+#define mark_profile_frame()
+
+#endif
@@ -0,0 +1,168 @@
+//
+// reload.c
+//
+// This file contains:
+//     - Asset hot reloading (for development).
+//
+
+//
+// Hot reloading.
+//
+// When the game is built with HOT_RELOAD defined (on Linux), the assets
+// directory is watched with inotify. When one of the asset files is written,
+// a background thread decodes just that file into the reserve pool, and the
+// new asset is swapped in between frames by apply_asset_reloads. Scenes keep
+// their own copies of the animations and sounds they use, so any copies in the
+// current scene's state are brought up to date as well, without restarting the
+// scene. Nothing else in the pools is touched.
+//
+// Reloaded assets are never freed, so once the reserve pool is full the game
+// needs to be restarted to pick up any more changes.
+//
+
+#if defined(HOT_RELOAD) && defined(__linux__)
+
+#include <sys/inotify.h>
+
+#define MAX_PENDING_RELOADS 16
+
+// An asset that has been decoded, waiting to be swapped in.
+typedef struct
+{
+    Asset * asset;
+    Asset staged;
+}
+Pending_Reload;
+
+struct
+{
+    SDL_Thread * thread;
+    SDL_mutex * lock;
+    int watch_file;
+    Pending_Reload pending[MAX_PENDING_RELOADS];
+    int pending_count;
+}
+hot_reload;
+
+// Decode a changed asset file and queue it to be swapped in.
+void reload_asset_file(char * file_name)
+{
+    Asset * asset = find_asset_by_file_name(file_name);
+    if (!asset) return;
+
+    // Load into a copy of the asset, so that the one currently in use is not
+    // touched until the main thread swaps it. From now on it comes from its
+    // own file rather than the archive.
+    Pending_Reload reload = { .asset = asset, .staged = *asset };
+    reload.staged.archive_entry = NULL;
+    u64 start_ticks = SDL_GetPerformanceCounter();
+    if (!load_asset_file(RESERVE_POOL, &reload.staged))
+    {
+        printf("Could not reload %s (the reserve pool may be full).\n", file_name);
+        return;
+    }
+    reload.staged.load_time_ms = (SDL_GetPerformanceCounter() - start_ticks)
+        / (SDL_GetPerformanceFrequency() / 1000.0);
+
+    SDL_LockMutex(hot_reload.lock);
+    if (hot_reload.pending_count < MAX_PENDING_RELOADS)
+    {
+        hot_reload.pending[hot_reload.pending_count++] = reload;
+    }
+    SDL_UnlockMutex(hot_reload.lock);
+}
+
+int hot_reload_thread(void * data)
+{
+    // Large enough for a few events with file names.
+    u8 buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (true)
+    {
+        int byte_count = read(hot_reload.watch_file, buffer, sizeof(buffer));
+        if (byte_count <= 0)
+        {
+            if (errno == EINTR) continue;
+            return 1;
+        }
+        for (int offset = 0; offset < byte_count;)
+        {
+            struct inotify_event * event = (struct inotify_event *)(buffer + offset);
+            if (event->len) reload_asset_file(event->name);
+            offset += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    return 0;
+}
+
+// Start watching the current directory for changes to asset files.
+// Returns false if hot reloading could not be started.
+bool start_hot_reload(u64 reserve_byte_count)
+{
+    if (!init_reserve_pool(reserve_byte_count)) return false;
+    hot_reload.lock = SDL_CreateMutex();
+    hot_reload.watch_file = inotify_init();
+    if (!hot_reload.lock || hot_reload.watch_file < 0) return false;
+    // Editors either write the file in place or move a new file over it.
+    if (inotify_add_watch(hot_reload.watch_file, ".",
+        IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+        return false;
+    }
+    hot_reload.thread = SDL_CreateThread(hot_reload_thread, "hot reload", NULL);
+    return hot_reload.thread != NULL;
+}
+
+// Update any copies of an animation or sound in the current scene's state,
+// found by them pointing at the old asset's data. Animations keep their own
+// start times.
+void refresh_scene_asset_copies(Asset * old_asset, Asset * new_asset)
+{
+    u8 * state = current_scene.state;
+    int byte_count = current_scene.state_byte_count;
+    for (int i = 0; i < byte_count; i += sizeof(void *))
+    {
+        if (new_asset->kind == ASSET_ANIMATION && i + sizeof(Animated_Image) <= byte_count)
+        {
+            Animated_Image * copy = (Animated_Image *)(state + i);
+            Animated_Image * old = &old_asset->animation;
+            if (copy->pixels == old->pixels && copy->indices == old->indices &&
+                copy->palette == old->palette)
+            {
+                int start_time_ms = copy->start_time_ms;
+                *copy = new_asset->animation;
+                copy->start_time_ms = start_time_ms;
+            }
+        }
+        else if (new_asset->kind == ASSET_SOUND && i + sizeof(Sound) <= byte_count)
+        {
+            Sound * copy = (Sound *)(state + i);
+            if (copy->samples == old_asset->sound.samples) *copy = new_asset->sound;
+        }
+    }
+}
+
+// Swap in any assets that have been reloaded. Should be called between frames.
+void apply_asset_reloads()
+{
+    if (!__atomic_load_n(&hot_reload.pending_count, __ATOMIC_RELAXED)) return;
+
+    SDL_LockMutex(hot_reload.lock);
+    for (int i = 0; i < hot_reload.pending_count; ++i)
+    {
+        Pending_Reload * reload = &hot_reload.pending[i];
+        Asset old_asset = *reload->asset;
+        *reload->asset = reload->staged;
+        refresh_scene_asset_copies(&old_asset, reload->asset);
+        printf("Reloaded %s in %.2fms\n",
+            reload->asset->name, reload->asset->load_time_ms);
+    }
+    hot_reload.pending_count = 0;
+    SDL_UnlockMutex(hot_reload.lock);
+}
+
+#else
+
+bool start_hot_reload(u64 reserve_byte_count) { return false; }
+void apply_asset_reloads() {}
+
+#endif
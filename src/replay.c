@@ -0,0 +1,257 @@
+//
+// replay.c
+//
+// This file contains:
+//     - Input recording.
+//     - Replay log reading.
+//     - Game state hashing.
+//
+
+//
+// Recording and replay.
+//
+// With --record, everything that can change the game is written to a log: the
+// random seed it started with, then each frame and each input in the order
+// they happened. Only frames step the game clock (see step_game_clock), so a
+// frame record holds how far the real time had moved since the one before.
+// With --replay, the game is run again from the log with no window, no audio
+// device and the game clock set from the log instead of the real clock, so it
+// goes through exactly the same states as it did when recorded, as fast as it
+// can.
+//
+// Records are twelve bytes each. For a frame, value is unused. For an input,
+// code is the player and value is the time stamp relative to the last step of
+// the clock, in microseconds (so that the time stamp can be rebuilt). The debug
+// keys change the game too, so they are recorded as well, with the scancode as
+// code. The log ends with hashes of the scene state and the last frame, which a
+// replay checks its own against.
+//
+
+#define REPLAY_MAGIC "RHYTHMRP"
+#define REPLAY_VERSION 2
+
+typedef struct
+{
+    char magic[8];
+    u32 version;
+    u32 record_byte_count;
+    u64 random_seed[2];
+    u64 clock_start_us;
+}
+Replay_Header;
+
+typedef enum
+{
+    REPLAY_FRAME,
+    REPLAY_INPUT,
+    REPLAY_KEY,
+    REPLAY_END,
+}
+Replay_Record_Kind;
+
+typedef struct
+{
+    u8 kind;
+    u8 pressed;
+    u16 code;
+    u32 delta_us;
+    s32 value;
+}
+Replay_Record;
+
+typedef struct
+{
+    u64 state_hash;
+    u64 frame_hash;
+}
+Replay_Hashes;
+
+struct
+{
+    FILE * file;
+    bool recording;
+    // The real game clock time of the last record.
+    u64 time_us;
+    u64 record_count;
+}
+replay;
+
+//
+// Game state hashing.
+//
+
+// Globals are within this distance of current_scene.
+#define REPLAY_GLOBALS_RANGE megabytes(64)
+
+// If a word of scene state points into the memory pools, into the mapped asset
+// archive (for assets used straight from it) or at a global (such as the next
+// scene of the blank scene), return it as an offset into its pool or the
+// archive, or from current_scene. None of those are at the same address each
+// time the game runs. Any other word is returned as it is.
+static u64 rebase_state_word(u64 word)
+{
+    for (int pool = 0; pool <= RESERVE_POOL; ++pool)
+    {
+        u64 memory = (u64)memory_pools[pool].memory;
+        if (memory && word >= memory && word < memory + memory_pools[pool].bytes_available)
+        {
+            return ((u64)pool << 56) | (word - memory);
+        }
+    }
+    u64 archive = (u64)asset_archive;
+    if (archive && word >= archive && word < archive + asset_archive_byte_count)
+    {
+        return ((u64)(RESERVE_POOL + 1) << 56) | (word - archive);
+    }
+    u64 globals = (u64)&current_scene;
+    if (word > globals - REPLAY_GLOBALS_RANGE && word < globals + REPLAY_GLOBALS_RANGE)
+    {
+        return word - globals;
+    }
+    return word;
+}
+
+// Hash the current scene's state and the random seed.
+u64 hash_scene_state()
+{
+    u64 hash = hash_bytes(random_seed, sizeof(random_seed), 0);
+    hash = hash_bytes(&current_scene.asset_group, sizeof(current_scene.asset_group), hash);
+    u8 * state = current_scene.state;
+    for (int i = 0; i + sizeof(u64) <= current_scene.state_byte_count; i += sizeof(u64))
+    {
+        u64 word;
+        memcpy(&word, state + i, sizeof(word));
+        word = rebase_state_word(word);
+        hash = hash_bytes(&word, sizeof(word), hash);
+    }
+    return hash;
+}
+
+u64 hash_frame()
+{
+    return hash_bytes(pixels, WIDTH * HEIGHT * sizeof(pixels[0]), 0);
+}
+
+//
+// Recording.
+//
+
+static void write_replay_record(Replay_Record_Kind kind, int code, bool pressed,
+    s32 value)
+{
+    if (!replay.recording) return;
+    Replay_Record record =
+    {
+        .kind = kind,
+        .pressed = pressed,
+        .code = code,
+        .delta_us = game_clock.real_time_us - replay.time_us,
+        .value = value,
+    };
+    replay.time_us = game_clock.real_time_us;
+    fwrite(&record, sizeof(record), 1, replay.file);
+    ++replay.record_count;
+}
+
+// Start recording to a file. Should be called just after the game clock has
+// started, before anything has happened.
+// Returns false if the file could not be written.
+bool start_recording(char * file_name)
+{
+    replay.file = fopen(file_name, "wb");
+    if (!replay.file) return false;
+    Replay_Header header =
+    {
+        .magic = REPLAY_MAGIC,
+        .version = REPLAY_VERSION,
+        .record_byte_count = sizeof(Replay_Record),
+        .random_seed = { random_seed[0], random_seed[1] },
+        .clock_start_us = game_clock.start_us,
+    };
+    replay.recording = fwrite(&header, sizeof(header), 1, replay.file) == 1;
+    replay.time_us = game_clock.real_time_us;
+    return replay.recording;
+}
+
+void record_frame()
+{
+    write_replay_record(REPLAY_FRAME, 0, false, 0);
+}
+
+void record_input(int player, bool pressed, u64 time_stamp_us)
+{
+    s64 offset_us = time_stamp_us - (game_clock.start_us + game_clock.real_time_us);
+    write_replay_record(REPLAY_INPUT, player, pressed,
+        clamp(INT32_MIN, offset_us, INT32_MAX));
+}
+
+void record_key(SDL_Scancode scancode)
+{
+    write_replay_record(REPLAY_KEY, scancode, true, 0);
+}
+
+// Finish the log with the final hashes and close it.
+void finish_recording()
+{
+    if (!replay.recording) return;
+    write_replay_record(REPLAY_END, 0, false, 0);
+    Replay_Hashes hashes = { hash_scene_state(), hash_frame() };
+    fwrite(&hashes, sizeof(hashes), 1, replay.file);
+    fclose(replay.file);
+    replay.recording = false;
+    printf("Recorded %llu events.\n", (unsigned long long)replay.record_count);
+}
+
+//
+// Replay.
+//
+
+// Open a log to be replayed, and set the random seed and game clock to how
+// they were at the start of the recording.
+// Returns false if the file could not be read or is not a replay log.
+bool start_replay(char * file_name)
+{
+    replay.file = fopen(file_name, "rb");
+    if (!replay.file) return false;
+    Replay_Header header;
+    if (fread(&header, sizeof(header), 1, replay.file) != 1 ||
+        memcmp(header.magic, REPLAY_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != REPLAY_VERSION ||
+        header.record_byte_count != sizeof(Replay_Record))
+    {
+        fclose(replay.file);
+        return false;
+    }
+    random_seed[0] = header.random_seed[0];
+    random_seed[1] = header.random_seed[1];
+    // Input time stamps are kept by scenes, so the clock starts where it did.
+    start_game_clock();
+    game_clock.start_us = header.clock_start_us;
+    replay.time_us = 0;
+    return true;
+}
+
+// Read the next record and move the game clock on to when it happened.
+// Returns false at the end of the log.
+bool next_replay_record(Replay_Record * record)
+{
+    if (fread(record, sizeof(*record), 1, replay.file) != 1) return false;
+    if (record->kind == REPLAY_FRAME) advance_game_clock(record->delta_us);
+    ++replay.record_count;
+    return true;
+}
+
+// Rebuild the time stamp of an input record.
+u64 get_replay_time_stamp(Replay_Record * record)
+{
+    return game_clock.start_us + game_clock.real_time_us + record->value;
+}
+
+// Read the hashes at the end of the log, after the REPLAY_END record.
+// Returns false if there are none.
+bool read_replay_hashes(Replay_Hashes * hashes)
+{
+    bool read = fread(hashes, sizeof(*hashes), 1, replay.file) == 1;
+    fclose(replay.file);
+    return read;
+}
@@ -11,20 +11,44 @@
 //
 // A scene is a set of functions and a struct of state variables that can be
 // swapped out at will. The start function is called when the scene is entered,
-// the frame function is called when the frame needs to be redrawn, and the
-// input function is called when a player presses a button.
+// the update function is called at a fixed rate to move the game along, the
+// render function is called when the frame needs to be redrawn, and the input
+// function is called when a player presses or releases a button. The feedback
+// function, if there is one, is called for the same input straight away from
+// the input thread, for sounds that must not wait for the next frame. The size
+// of the state struct is recorded so that it can be captured by a snapshot.
 //
+// Updates always step by the same amount of time, UPDATE_TIME_STEP, however
+// fast frames are being drawn, so the game plays the same at any frame rate.
+// Each frame runs as many updates as fit in the time that has passed, and the
+// render function is given how far it is between the last update and the next
+// one (from 0 to 1), which it can use to interpolate between them. If the game
+// falls too far behind, the missed time is dropped rather than caught up.
+//
+// Each scene names the group of assets that it uses. They are loaded into the
+// scene pool when the scene is set, unless they have already been prefetched.
+//
+
+#define UPDATE_RATE 240
+#define UPDATE_TIME_STEP (1.0f / UPDATE_RATE)
+#define MAX_UPDATES_PER_FRAME 24
 
-typedef void (* Frame_Func)(void * state, f32 delta_time);
 typedef void (* Start_Func)(void * state);
-typedef void (* Input_Func)(void * state, int player, bool pressed, u32 time_stamp_ms);
+typedef void (* Update_Func)(void * state, f32 time_step);
+typedef void (* Render_Func)(void * state, f32 alpha);
+typedef void (* Input_Func)(void * state, int player, bool pressed, u64 time_stamp_us);
 
 typedef struct
 {
     Start_Func start;
-    Frame_Func frame;
+    Update_Func update;
+    Render_Func render;
     Input_Func input;
+    // Optional, called from the input thread (see input.c).
+    Feedback_Func feedback;
     void * state;
+    u64 state_byte_count;
+    Asset_Group asset_group;
 }
 Scene;
 
@@ -35,25 +59,247 @@ extern Scene lungs_scene;
 extern Scene digestion_scene;
 
 
+// The group of assets held in the scene pool, and the number of bytes they
+// take up at the bottom of it.
+Asset_Group scene_asset_group = ASSET_GROUP_SHARED;
+u64 scene_asset_byte_count = 0;
+
+// Make sure that the scene pool holds a group of assets, and nothing else.
+// Exits the program if the assets cannot be loaded.
+void load_scene_assets(Asset_Group group)
+{
+    // A prefetch may still be loading into the scene pool, so wait for it
+    // before the pool is touched.
+    if (finish_asset_prefetch(group))
+    {
+        scene_asset_group = group;
+        scene_asset_byte_count = memory_pools[SCENE_POOL].bytes_filled;
+    }
+    else if (group == scene_asset_group)
+    {
+        // Keep the assets, but free everything after them.
+        memory_pools[SCENE_POOL].bytes_filled = scene_asset_byte_count;
+        memory_pools[SCENE_POOL].byte_count_of_last_alloc = 0;
+    }
+    else
+    {
+        flush_pool(SCENE_POOL);
+        scene_asset_group = ASSET_GROUP_SHARED;
+        if (group != ASSET_GROUP_SHARED &&
+            !load_asset_group(SCENE_POOL, group, 0))
+        {
+            panic_exit("Could not load the assets for a scene.\n%s",
+                strerror(errno));
+        }
+        scene_asset_group = group;
+        scene_asset_byte_count = memory_pools[SCENE_POOL].bytes_filled;
+    }
+}
+
 // Change the current scene.
 // Will call the start function for that scene.
 // Returns true if successful.
 bool set_scene(Scene scene)
 {
-    // Clear scene and frame memory pools.
-    flush_pool(SCENE_POOL);
+    // Clear scene and frame memory pools, keeping any prefetched assets.
+    load_scene_assets(scene.asset_group);
     flush_pool(FRAME_POOL);
     // Set function pointers.
-    if (scene.start && scene.frame && scene.input && scene.state)
+    if (scene.start && scene.update && scene.render && scene.input && scene.state)
     {
         current_scene = scene;
+        set_input_feedback(scene.feedback);
         // Call the start function for the new scene.
+        PROFILE_ZONE("scene_start");
         current_scene.start(current_scene.state);
         return true;
     }
     return false;
 }
 
+// Time that has passed but not yet been simulated by updates.
+f32 update_time_accumulator;
+
+// Run the current scene's updates for the time since the last frame, then
+// render it.
+void run_scene(f32 delta_time)
+{
+    update_time_accumulator += delta_time;
+    int update_count = 0;
+    while (update_time_accumulator >= UPDATE_TIME_STEP)
+    {
+        if (update_count == MAX_UPDATES_PER_FRAME)
+        {
+            update_time_accumulator = 0.0;
+            break;
+        }
+        // The update may change the scene, in which case the new one carries on.
+        {
+            PROFILE_ZONE("scene_update");
+            current_scene.update(current_scene.state, UPDATE_TIME_STEP);
+        }
+        update_time_accumulator -= UPDATE_TIME_STEP;
+        ++update_count;
+    }
+    PROFILE_ZONE("scene_render");
+    current_scene.render(current_scene.state,
+        update_time_accumulator / UPDATE_TIME_STEP);
+}
+
+//
+// Snapshots.
+//
+// A snapshot captures all of the mutable game state: the current scene and its
+// state struct, the mixer channels, the random seed and the contents of the
+// scene pool above the scene's assets (which never change). Snapshots are
+// stored in a ring of buffers that are allocated up front, so taking and
+// restoring one is only a handful of large copies. This is used to rewind play
+// by a few seconds, or to re-simulate from a known point without calling a
+// scene's start function or reloading any assets.
+//
+
+typedef struct
+{
+    Scene scene;
+    u8 * scene_state;
+    Mixer_Channel * channels;
+    u8 * scene_pool;
+    u64 scene_pool_byte_count;
+    u64 scene_asset_byte_count;
+    u64 random_seed[2];
+    u64 time_us;
+    bool taken;
+}
+Snapshot;
+
+// The largest scene state struct that can be captured.
+#define SNAPSHOT_STATE_MAX_BYTES 4096
+
+struct
+{
+    Snapshot * snapshots;
+    int snapshot_count;
+    int next_snapshot;
+    u64 scene_pool_max_byte_count;
+}
+snapshot_ring;
+
+// Allocate a ring of snapshot_count snapshots, each of which can hold up to
+// scene_pool_max_byte_count bytes of the scene pool.
+// Returns false if the memory could not be allocated.
+bool init_snapshots(int pool_index, int snapshot_count,
+    u64 scene_pool_max_byte_count)
+{
+    snapshot_ring.snapshots = pool_alloc(pool_index,
+        snapshot_count * sizeof(Snapshot));
+    if (!snapshot_ring.snapshots) return false;
+    for (int i = 0; i < snapshot_count; ++i)
+    {
+        Snapshot * snapshot = &snapshot_ring.snapshots[i];
+        *snapshot = (Snapshot){};
+        snapshot->scene_state = pool_alloc(pool_index, SNAPSHOT_STATE_MAX_BYTES);
+        snapshot->channels = pool_alloc(pool_index,
+            mixer.channel_count * sizeof(Mixer_Channel));
+        snapshot->scene_pool = pool_alloc(pool_index, scene_pool_max_byte_count);
+        if (!snapshot->scene_state || !snapshot->channels || !snapshot->scene_pool)
+        {
+            return false;
+        }
+    }
+    snapshot_ring.snapshot_count = snapshot_count;
+    snapshot_ring.next_snapshot = 0;
+    snapshot_ring.scene_pool_max_byte_count = scene_pool_max_byte_count;
+    return true;
+}
+
+// Capture the current game state into the next snapshot in the ring,
+// overwriting the oldest one. No snapshot is taken while a prefetch is loading
+// into the scene pool (see prefetch_asset_group).
+// Returns false if the state does not fit in a snapshot, or cannot be taken.
+bool take_snapshot()
+{
+    PROFILE_ZONE("take_snapshot");
+    if (!snapshot_ring.snapshot_count || asset_prefetch.thread) return false;
+    Memory_Pool * scene_pool = &memory_pools[SCENE_POOL];
+    u64 scene_pool_byte_count = scene_pool->bytes_filled - scene_asset_byte_count;
+    if (current_scene.state_byte_count > SNAPSHOT_STATE_MAX_BYTES ||
+        scene_pool_byte_count > snapshot_ring.scene_pool_max_byte_count)
+    {
+        return false;
+    }
+
+    Snapshot * snapshot = &snapshot_ring.snapshots[snapshot_ring.next_snapshot];
+    snapshot->scene = current_scene;
+    snapshot->time_us = game_clock.time_us;
+    snapshot->random_seed[0] = random_seed[0];
+    snapshot->random_seed[1] = random_seed[1];
+
+    // memcpy is used for these as they can be large.
+    memcpy(snapshot->scene_state, current_scene.state,
+        current_scene.state_byte_count);
+    memcpy(snapshot->scene_pool, scene_pool->memory + scene_asset_byte_count,
+        scene_pool_byte_count);
+    snapshot->scene_pool_byte_count = scene_pool_byte_count;
+    snapshot->scene_asset_byte_count = scene_asset_byte_count;
+
+    SDL_LockAudioDevice(audio_device);
+    memcpy(snapshot->channels, mixer.channels,
+        mixer.channel_count * sizeof(Mixer_Channel));
+    SDL_UnlockAudioDevice(audio_device);
+
+    snapshot->taken = true;
+    snapshot_ring.next_snapshot =
+        (snapshot_ring.next_snapshot + 1) % snapshot_ring.snapshot_count;
+    return true;
+}
+
+// Restore the game state from a snapshot, where steps_back is the number of
+// snapshots to go back (1 being the most recent). The snapshots newer than the
+// restored one are discarded, so that play continues from that point.
+// Returns false if there is no such snapshot.
+bool restore_snapshot(int steps_back)
+{
+    int count = snapshot_ring.snapshot_count;
+    if (steps_back < 1 || steps_back > count) return false;
+    int index = (snapshot_ring.next_snapshot - steps_back + count) % count;
+    Snapshot * snapshot = &snapshot_ring.snapshots[index];
+    if (!snapshot->taken) return false;
+
+    // The snapshot may be from a scene that uses other assets. They are loaded
+    // in the same order each time, so they take up the same space. This also
+    // waits for any prefetch, so nothing else is writing to the scene pool.
+    load_scene_assets(snapshot->scene.asset_group);
+    if (scene_asset_byte_count != snapshot->scene_asset_byte_count) return false;
+
+    current_scene = snapshot->scene;
+    set_input_feedback(current_scene.feedback);
+    random_seed[0] = snapshot->random_seed[0];
+    random_seed[1] = snapshot->random_seed[1];
+    // Scene timers and animations are in game time, so it goes back too.
+    game_clock.time_us = snapshot->time_us;
+
+    memcpy(current_scene.state, snapshot->scene_state,
+        current_scene.state_byte_count);
+    Memory_Pool * scene_pool = &memory_pools[SCENE_POOL];
+    memcpy(scene_pool->memory + scene_asset_byte_count, snapshot->scene_pool,
+        snapshot->scene_pool_byte_count);
+    scene_pool->bytes_filled = scene_asset_byte_count + snapshot->scene_pool_byte_count;
+    scene_pool->byte_count_of_last_alloc = 0;
+
+    SDL_LockAudioDevice(audio_device);
+    memcpy(mixer.channels, snapshot->channels,
+        mixer.channel_count * sizeof(Mixer_Channel));
+    SDL_UnlockAudioDevice(audio_device);
+
+    // Forget the snapshots that were taken after this one.
+    for (int i = 1; i < steps_back; ++i)
+    {
+        snapshot_ring.snapshots[(index + i) % count].taken = false;
+    }
+    snapshot_ring.next_snapshot = (index + 1) % count;
+    return true;
+}
+
 //
 // Blank scene.
 //
@@ -73,10 +319,10 @@ Blank_State;
 
 Blank_State blank_state;
 
-void blank_frame(void * state, f32 delta_time)
+void blank_update(void * state, f32 time_step)
 {
     Blank_State * s = state;
-    if (s->end_time < SDL_GetTicks())
+    if (s->end_time < get_ticks())
     {
         if (s->end_sound.samples)
         {
@@ -84,24 +330,36 @@ void blank_frame(void * state, f32 delta_time)
         }
         set_scene(*s->next_scene);
     }
+}
+
+void blank_render(void * state, f32 alpha)
+{
+    Blank_State * s = state;
     clear(s->colour);
 }
 
-// Stub functions, as nothing needs to be done for this scene.
+// Start loading the next scene's assets while the screen is blank.
 void blank_start(void * state)
 {
     Blank_State * s = state;
-    s->end_time = SDL_GetTicks() + (1000 * s->time_in_seconds);
+    s->end_time = get_ticks() + (1000 * s->time_in_seconds);
+    if (s->next_scene->asset_group != ASSET_GROUP_SHARED)
+    {
+        prefetch_asset_group(s->next_scene->asset_group);
+    }
 }
 
-void blank_input(void * state, int player, bool pressed, u32 time_stamp_ms) {}
+// Stub function, as nothing needs to be done for this scene.
+void blank_input(void * state, int player, bool pressed, u64 time_stamp_us) {}
 
 Scene blank_scene =
 {
     .start = blank_start,
-    .frame = blank_frame,
+    .update = blank_update,
+    .render = blank_render,
     .input = blank_input,
     .state = &blank_state,
+    .state_byte_count = sizeof(blank_state),
 };
 
 void prepare_blank_cut(f32 time_in_seconds, u32 colour,
@@ -114,8 +372,6 @@ void prepare_blank_cut(f32 time_in_seconds, u32 colour,
         .colour = colour,
         .end_sound = end_sound ? *end_sound : (Sound){},
     };
-
-    set_scene(blank_scene);
 }
 
 void blank_cut(f32 time_in_seconds, u32 colour,
@@ -130,31 +386,61 @@ void blank_cut(f32 time_in_seconds, u32 colour,
 //
 // A tutorial interface which helps players improve their accuracy.
 //
+// The scale and its labels only change with the range, so they are drawn into
+// a cached overlay. The accuracy marker, arrows and buttons are drawn live.
+//
+
+Overlay accuracy_overlay;
+
+// How far the shown accuracy moves towards the measured accuracy each update.
+// (The same as 0.05 per frame at 60 frames per second.)
+#define ACCURACY_SMOOTHING 0.0127f
+
 void draw_accuracy_interface(f32 accuracy,
     f32 range, f32 bpm,
     bool draw_left_arrow, bool draw_right_arrow,
     bool left_state, bool right_state)
 {
+    PROFILE_ZONE("accuracy_interface");
     f32 yellow_range = range * 5.0;
     f32 red_range = range * 10.0f;
     f32 scale = 100.0 / red_range;
 
     int y = 10;
-    draw_line(WIDTH / 2 - red_range * scale, HEIGHT - y,
-        WIDTH / 2 + red_range * scale, HEIGHT - y,
-        0xff0000ff);
-    draw_line(WIDTH / 2 - yellow_range * scale, HEIGHT - y,
-        WIDTH / 2 + yellow_range * scale, HEIGHT - y,
-        0xffff00ff);
-    draw_line(WIDTH / 2 - range * scale, HEIGHT - y,
-        WIDTH / 2 + range * scale, HEIGHT - y,
-        0x00ff00ff);
-    draw_line(WIDTH / 2 - range * scale, HEIGHT - (y - 1),
-        WIDTH / 2 - range * scale, HEIGHT - (y + 1),
-        0x00ff00ff);
-    draw_line(WIDTH / 2 + range * scale, HEIGHT - (y - 1),
-        WIDTH / 2 + range * scale, HEIGHT - (y + 1),
-        0x00ff00ff);
+    Font font = get_font(find_font("main_font"));
+    u64 key = hash_bytes(&range, sizeof(range), 0);
+    key = hash_bytes(&font.pixels, sizeof(font.pixels), key);
+    if (begin_overlay(&accuracy_overlay, PERSIST_POOL, key))
+    {
+        draw_line(WIDTH / 2 - red_range * scale, HEIGHT - y,
+            WIDTH / 2 + red_range * scale, HEIGHT - y,
+            0xff0000ff);
+        draw_line(WIDTH / 2 - yellow_range * scale, HEIGHT - y,
+            WIDTH / 2 + yellow_range * scale, HEIGHT - y,
+            0xffff00ff);
+        draw_line(WIDTH / 2 - range * scale, HEIGHT - y,
+            WIDTH / 2 + range * scale, HEIGHT - y,
+            0x00ff00ff);
+        draw_line(WIDTH / 2 - range * scale, HEIGHT - (y - 1),
+            WIDTH / 2 - range * scale, HEIGHT - (y + 1),
+            0x00ff00ff);
+        draw_line(WIDTH / 2 + range * scale, HEIGHT - (y - 1),
+            WIDTH / 2 + range * scale, HEIGHT - (y + 1),
+            0x00ff00ff);
+
+        draw_text(font,
+            WIDTH / 2 - red_range * scale - 30,
+            HEIGHT - (y + 6),
+            ~0,
+            "slow");
+        draw_text(font,
+            WIDTH / 2 + red_range * scale + 5,
+            HEIGHT - (y + 6),
+            ~0,
+            "fast");
+        end_overlay(&accuracy_overlay);
+    }
+    draw_overlay(&accuracy_overlay);
 
     draw_line(WIDTH / 2 + accuracy * scale, HEIGHT - (y - 1),
         WIDTH / 2 + accuracy * scale, HEIGHT - (y + 1),
@@ -166,18 +452,7 @@ void draw_accuracy_interface(f32 accuracy,
         WIDTH / 2 + accuracy * scale + 1, HEIGHT - (y + 1),
         ~0);
 
-    draw_text(assets.main_font,
-        WIDTH / 2 - red_range * scale - 30,
-        HEIGHT - (y + 6),
-        ~0,
-        "slow");
-    draw_text(assets.main_font,
-        WIDTH / 2 + red_range * scale + 5,
-        HEIGHT - (y + 6),
-        ~0,
-        "fast");
-
-    y = 80 + sinf((M_PI*2.0) * SDL_GetTicks() * 0.001 * (bpm / 60.0)) * 5;
+    y = 80 + sinf((M_PI*2.0) * get_game_time() * (bpm / 60.0)) * 5;
     if (draw_left_arrow)
     {
         draw_line(44, y,      44,     y + 10, ~0);
@@ -192,8 +467,9 @@ void draw_accuracy_interface(f32 accuracy,
         draw_line(274, y + 10, 274 + 5, y +  5, ~0);
     }
 
-    draw_animated_image_frame(assets.button_animation, left_state,   15, 110);
-    draw_animated_image_frame(assets.button_animation, right_state, 245, 110);
+    Animated_Image button = get_animation(find_animation("button"));
+    draw_animated_image_frame(button, left_state,   15, 110);
+    draw_animated_image_frame(button, right_state, 245, 110);
 }
 
 //
@@ -208,10 +484,11 @@ typedef struct
 {
     Animated_Image heart;
     bool player_states[2];
-    int time_stamps[2];
-    int delta_ms;
+    u64 time_stamps_us[2];
+    f32 delta_ms;
     f32 target_beats_per_minute;
     f32 accuracy;
+    f32 previous_accuracy;
     f32 accuracy_timer;
     f32 target_accuracy_time;
     bool expanding;
@@ -225,77 +502,90 @@ void heart_start(void * state)
 {
     Heart_State * s = state;
     *s = (Heart_State){};
-    s->heart = assets.heart_animation;
+    s->heart = get_animation(find_animation("heart"));
     s->heart.frame_duration_ms = 30;
     s->target_beats_per_minute = 60.0;
     s->accuracy = -50.0;
     s->target_accuracy_time = 10.0;
-    if (!sound_is_playing(&mixer, assets.brown_sound))
+    if (!sound_is_playing(&mixer, get_sound(find_sound("brown"))))
     {
-        play_sound(&mixer, assets.brown_sound, 0.05, 0.05, true);
+        play_sound(&mixer, get_sound(find_sound("brown")), 0.05, 0.05, true);
     }
 }
 
-void heart_frame(void * state, f32 delta_time)
+#define HEART_RANGE 5.0
+
+void heart_update(void * state, f32 time_step)
 {
     Heart_State * s = state;
+    s->previous_accuracy = s->accuracy;
 
-    draw_noise(s->accuracy_timer * 0.5);
-
-    if (s->expanding)
-    {
-        draw_animated_image_frames_and_wait(s->heart, 0, 3, 0, 20);
-    }
-    else
-    {
-        draw_animated_image_frames_and_wait(s->heart, 4, 6, 0, 20);
-    }
-
-    f32 range = 5.0;
-    if (s->time_stamps[0] && s->time_stamps[1])
+    f32 range = HEART_RANGE;
+    if (s->time_stamps_us[0] && s->time_stamps_us[1])
     {
         f32 beats_per_minute = 60.0f / (s->delta_ms * 0.001f);
         f32 d = s->target_beats_per_minute - beats_per_minute;
         d = clamp(-range * 10.0, -d, range * 10.0);
-        s->accuracy += (d - s->accuracy) * 0.05;
+        s->accuracy += (d - s->accuracy) * ACCURACY_SMOOTHING;
     }
 
-    s->accuracy_timer += delta_time / s->target_accuracy_time;
+    s->accuracy_timer += time_step / s->target_accuracy_time;
     if (fabsf(s->accuracy) > range) s->accuracy_timer = 0.0;
-    s->accuracy -= delta_time;
+    s->accuracy -= time_step;
+}
+
+void heart_render(void * state, f32 alpha)
+{
+    Heart_State * s = state;
+
+    int frame = s->expanding ?
+        get_animation_frames_and_wait_index(s->heart, 0, 3, NULL) :
+        get_animation_frames_and_wait_index(s->heart, 4, 6, NULL);
+    occlude_animated_image_frame(s->heart, frame, 0, 20);
+
+    draw_noise(s->accuracy_timer * 0.5);
+    draw_animated_image_frame(s->heart, frame, 0, 20);
 
     if (s->draw_interface)
     {
-        draw_accuracy_interface(s->accuracy, range,
+        f32 accuracy = s->previous_accuracy + (s->accuracy - s->previous_accuracy) * alpha;
+        draw_accuracy_interface(accuracy, HEART_RANGE,
             s->target_beats_per_minute,
             s->expanding, !s->expanding,
             s->player_states[0], s->player_states[1]);
     }
 }
 
-void heart_input(void * state, int player, bool pressed, u32 time_stamp_ms)
+void heart_feedback(int player, bool pressed)
 {
-    Heart_State * s = state;
-    s->player_states[player] = pressed;
     if (pressed)
     {
-        play_sound(&mixer, assets.wood_block_sound,
+        play_sound(&mixer, get_sound(find_sound("wood_block")),
             player ? 0.1 : 1.0,
             player ? 1.0 : 0.1,
             false);
+    }
+}
+
+void heart_input(void * state, int player, bool pressed, u64 time_stamp_us)
+{
+    Heart_State * s = state;
+    s->player_states[player] = pressed;
+    if (pressed)
+    {
         if (s->expanding != player)
         {
-            s->time_stamps[player] = time_stamp_ms;
-            s->heart.start_time_ms = time_stamp_ms;
-            int a = s->time_stamps[0];
-            int b = s->time_stamps[1];
-            if (a && b) s->delta_ms = abs(a - b);
+            s->time_stamps_us[player] = time_stamp_us;
+            s->heart.start_time_ms = input_time_to_ticks(time_stamp_us);
+            u64 a = s->time_stamps_us[0];
+            u64 b = s->time_stamps_us[1];
+            if (a && b) s->delta_ms = (a > b ? a - b : b - a) * 0.001;
             s->expanding = player;
         }
 
         if (s->accuracy_timer > 1.0)
         {
-            stop_sound(&mixer, assets.brown_sound);
+            stop_sound(&mixer, get_sound(find_sound("brown")));
             blank_cut(3.0, 0, &lungs_scene, NULL);
         }
     }
@@ -303,10 +593,14 @@ void heart_input(void * state, int player, bool pressed, u32 time_stamp_ms)
 
 Scene heart_scene =
 {
-    .frame = heart_frame,
+    .update = heart_update,
+    .render = heart_render,
     .start = heart_start,
     .input = heart_input,
+    .feedback = heart_feedback,
     .state = &heart_state,
+    .state_byte_count = sizeof(heart_state),
+    .asset_group = ASSET_GROUP_HEART,
 };
 
 //
@@ -322,10 +616,11 @@ typedef struct
     Animated_Image right_lung;
     f32 target_beats_per_minute;
     f32 accuracy;
+    f32 previous_accuracy;
     f32 accuracy_timer;
     f32 target_accuracy_time;
-    int delta_ms[2];
-    int time_stamps[2][2];
+    f32 delta_ms[2];
+    u64 time_stamps_us[2][2];
     int current_stamp[2];
     bool player_states[2];
     bool draw_interface;
@@ -339,44 +634,27 @@ void lungs_start(void * state)
     Lungs_State * s = state;
     *s = (Lungs_State){};
     s->target_beats_per_minute = 60.0;
-    s->left_lung = assets.left_lung_animation;
-    s->right_lung = assets.right_lung_animation;
+    s->left_lung = get_animation(find_animation("left_lung"));
+    s->right_lung = get_animation(find_animation("right_lung"));
     s->left_lung.frame_duration_ms = 60.0;
     s->right_lung.frame_duration_ms = 60.0;
     s->target_accuracy_time = 10.0;
     s->accuracy = -50.0;
-    if (!sound_is_playing(&mixer, assets.brown_sound))
+    if (!sound_is_playing(&mixer, get_sound(find_sound("brown"))))
     {
-        play_sound(&mixer, assets.brown_sound, 0.05, 0.05, true);
+        play_sound(&mixer, get_sound(find_sound("brown")), 0.05, 0.05, true);
     }
 }
 
-void lungs_frame(void * state, f32 delta_time)
+#define LUNGS_RANGE 5.0
+
+void lungs_update(void * state, f32 time_step)
 {
     Lungs_State * s = state;
+    s->previous_accuracy = s->accuracy;
 
-    draw_noise(s->accuracy_timer * 0.5);
-
-    if (s->player_states[0])
-    {
-        draw_animated_image_frames_and_wait(s->left_lung, 0, 3, 76, 40);
-    }
-    else
-    {
-        draw_animated_image_frames_and_wait(s->left_lung, 5, 7, 76, 40);
-    }
-
-    if (s->player_states[1])
-    {
-        draw_animated_image_frames_and_wait(s->right_lung, 0, 3, 76 + 75, 40);
-    }
-    else
-    {
-        draw_animated_image_frames_and_wait(s->right_lung, 5, 7, 76 + 75, 40);
-    }
-
-    f32 range = 5.0;
-    if (s->time_stamps[0] && s->time_stamps[1])
+    f32 range = LUNGS_RANGE;
+    if (s->time_stamps_us[0] && s->time_stamps_us[1])
     {
         f32 beats_per_minute[2];
         beats_per_minute[0] = 60.0f / (s->delta_ms[0] * 0.001f);
@@ -385,57 +663,90 @@ void lungs_frame(void * state, f32 delta_time)
         target_delta += s->target_beats_per_minute - beats_per_minute[1];
         target_delta /= 2.0;
         target_delta = clamp(-range * 10.0, -target_delta, range * 10.0);
-        s->accuracy += (target_delta - s->accuracy) * 0.05;
+        s->accuracy += (target_delta - s->accuracy) * ACCURACY_SMOOTHING;
     }
 
-    s->accuracy_timer += delta_time / s->target_accuracy_time;
+    s->accuracy_timer += time_step / s->target_accuracy_time;
     if (fabsf(s->accuracy) > range) s->accuracy_timer = 0.0;
-    s->accuracy -= delta_time;
+    s->accuracy -= time_step;
+}
+
+void lungs_render(void * state, f32 alpha)
+{
+    Lungs_State * s = state;
+
+    int left_frame = s->player_states[0] ?
+        get_animation_frames_and_wait_index(s->left_lung, 0, 3, NULL) :
+        get_animation_frames_and_wait_index(s->left_lung, 5, 7, NULL);
+    int right_frame = s->player_states[1] ?
+        get_animation_frames_and_wait_index(s->right_lung, 0, 3, NULL) :
+        get_animation_frames_and_wait_index(s->right_lung, 5, 7, NULL);
+    occlude_animated_image_frame(s->left_lung, left_frame, 76, 40);
+    occlude_animated_image_frame(s->right_lung, right_frame, 76 + 75, 40);
+
+    draw_noise(s->accuracy_timer * 0.5);
+    draw_animated_image_frame(s->left_lung, left_frame, 76, 40);
+    draw_animated_image_frame(s->right_lung, right_frame, 76 + 75, 40);
 
     if (s->draw_interface)
     {
-        draw_accuracy_interface(s->accuracy, range,
+        f32 accuracy = s->previous_accuracy + (s->accuracy - s->previous_accuracy) * alpha;
+        draw_accuracy_interface(accuracy, LUNGS_RANGE,
             s->target_beats_per_minute,
             true, true,
             s->player_states[0], s->player_states[1]);
     }
 }
 
-void lungs_input(void * state, int player, bool pressed, u32 time_stamp_ms)
+void lungs_feedback(int player, bool pressed)
+{
+    if (player == 0)
+    {
+        play_sound(&mixer, get_sound(find_sound("shaker")), 0.4, 0.04, false);
+    }
+    else
+    {
+        play_sound(&mixer, get_sound(find_sound("shaker")), 0.04, 0.4, false);
+    }
+}
+
+void lungs_input(void * state, int player, bool pressed, u64 time_stamp_us)
 {
     Lungs_State * s = state;
     s->player_states[player] = pressed;
-    s->time_stamps[player][s->current_stamp[player]] = time_stamp_ms;
-    int a = s->time_stamps[player][0];
-    int b = s->time_stamps[player][1];
-    if (a && b) s->delta_ms[player] = abs(a - b);
+    s->time_stamps_us[player][s->current_stamp[player]] = time_stamp_us;
+    u64 a = s->time_stamps_us[player][0];
+    u64 b = s->time_stamps_us[player][1];
+    if (a && b) s->delta_ms[player] = (a > b ? a - b : b - a) * 0.001;
 
     s->current_stamp[player] = !s->current_stamp[player];
 
     if (player == 0)
     {
-        s->left_lung.start_time_ms = SDL_GetTicks();
-        play_sound(&mixer, assets.shaker_sound, 0.4, 0.04, false);
+        s->left_lung.start_time_ms = input_time_to_ticks(time_stamp_us);
     }
     else
     {
-        s->right_lung.start_time_ms = SDL_GetTicks();
-        play_sound(&mixer, assets.shaker_sound, 0.04, 0.4, false);
+        s->right_lung.start_time_ms = input_time_to_ticks(time_stamp_us);
     }
 
     if (s->accuracy_timer > 1.0)
     {
-        stop_sound(&mixer, assets.brown_sound);
+        stop_sound(&mixer, get_sound(find_sound("brown")));
         blank_cut(3.0, 0, &digestion_scene, NULL);
     }
 }
 
 Scene lungs_scene =
 {
-    .frame = lungs_frame,
+    .update = lungs_update,
+    .render = lungs_render,
     .start = lungs_start,
     .input = lungs_input,
+    .feedback = lungs_feedback,
     .state = &lungs_state,
+    .state_byte_count = sizeof(lungs_state),
+    .asset_group = ASSET_GROUP_LUNGS,
 };
 
 //
@@ -450,10 +761,11 @@ typedef struct
     Animated_Image digestion;
     int current_beat;
     f32 accuracy;
+    f32 previous_accuracy;
     f32 accuracy_timer;
     f32 target_accuracy_time;
     f32 target_beats_per_minute;
-    int last_press_time_ms;
+    u64 last_press_time_us;
     bool draw_interface;
     bool player_states[2];
 
@@ -466,71 +778,86 @@ void digestion_start(void * state)
 {
     Digestion_State * s = state;
     *s = (Digestion_State){};
-    s->digestion = assets.digestion_animation;
+    s->digestion = get_animation(find_animation("digestion"));
     s->digestion.frame_duration_ms = 30;
     s->target_beats_per_minute = 60;
     s->accuracy = -50.0;
     s->target_accuracy_time = 10.0;
-    if (!sound_is_playing(&mixer, assets.brown_sound))
+    if (!sound_is_playing(&mixer, get_sound(find_sound("brown"))))
     {
-        play_sound(&mixer, assets.brown_sound, 0.05, 0.05, true);
+        play_sound(&mixer, get_sound(find_sound("brown")), 0.05, 0.05, true);
     }
 }
 
-void digestion_frame(void * state, f32 delta_time)
+#define DIGESTION_RANGE 5.0
+
+void digestion_update(void * state, f32 time_step)
 {
     Digestion_State * s = state;
-    draw_noise(s->accuracy_timer * 0.5);
+    s->previous_accuracy = s->accuracy;
 
+    // Go back to the start of the bar once the final beat has been animated.
     if (s->current_beat == 5)
     {
-        bool waiting = draw_animated_image_frames_and_wait(s->digestion, 4, 6, 117, 40);
+        bool waiting;
+        get_animation_frames_and_wait_index(s->digestion, 4, 6, &waiting);
         if (waiting) s->current_beat = 0;
     }
-    else
+
+    s->accuracy_timer += time_step / s->target_accuracy_time;
+    if (fabsf(s->accuracy) > DIGESTION_RANGE) s->accuracy_timer = 0.0;
+    s->accuracy -= time_step;
+}
+
+void digestion_render(void * state, f32 alpha)
+{
+    Digestion_State * s = state;
+    int frame = s->current_beat;
+    if (s->current_beat == 5)
     {
-        draw_animated_image_frame(s->digestion, s->current_beat, 117, 40);
+        frame = get_animation_frames_and_wait_index(s->digestion, 4, 6, NULL);
     }
+    occlude_animated_image_frame(s->digestion, frame, 117, 40);
 
-    f32 range = 5.0;
-    s->accuracy_timer += delta_time / s->target_accuracy_time;
-    if (fabsf(s->accuracy) > range) s->accuracy_timer = 0.0;
-    s->accuracy -= delta_time;
+    draw_noise(s->accuracy_timer * 0.5);
+    draw_animated_image_frame(s->digestion, frame, 117, 40);
 
     if (s->draw_interface)
     {
-        draw_accuracy_interface(s->accuracy,
-            range, s->target_beats_per_minute,
+        f32 accuracy = s->previous_accuracy + (s->accuracy - s->previous_accuracy) * alpha;
+        draw_accuracy_interface(accuracy,
+            DIGESTION_RANGE, s->target_beats_per_minute,
             s->current_beat < 4, s->current_beat == 4,
             s->player_states[0], s->player_states[1]);
     }
 }
 
-void digestion_input(void * state, int player, bool pressed, u32 time_stamp_ms)
+void digestion_input(void * state, int player, bool pressed, u64 time_stamp_us)
 {
     Digestion_State * s = state;
     s->player_states[player] = pressed;
     if (pressed)
     {
-        s->accuracy = (time_stamp_ms - s->last_press_time_ms) * 0.001;
+        s->accuracy = (time_stamp_us - s->last_press_time_us) * 0.000001;
         if ((s->current_beat < 4 && player == 0) || (s->current_beat == 4 && player == 1))
         {
             s->current_beat = (s->current_beat + 1) % 6;
-            s->digestion.start_time_ms = time_stamp_ms;
+            s->digestion.start_time_ms = input_time_to_ticks(time_stamp_us);
             if (s->current_beat == 5)
             {
-                play_sound(&mixer, assets.wood_block_sound, 0.3, 1.0, false);
+                play_sound(&mixer, get_sound(find_sound("wood_block")),
+                    0.3, 1.0, false);
             }
             else
             {
-                play_sound(&mixer, assets.tap_sound, 1.0, 0.3, false);
+                play_sound(&mixer, get_sound(find_sound("tap")), 1.0, 0.3, false);
             }
         }
-        s->last_press_time_ms = time_stamp_ms;
+        s->last_press_time_us = time_stamp_us;
 
         if (s->accuracy_timer > 1.0)
         {
-            stop_sound(&mixer, assets.brown_sound);
+            stop_sound(&mixer, get_sound(find_sound("brown")));
             blank_cut(3.0, 0, &heart_scene, NULL);
         }
     }
@@ -538,8 +865,11 @@ void digestion_input(void * state, int player, bool pressed, u32 time_stamp_ms)
 
 Scene digestion_scene =
 {
-    .frame = digestion_frame,
+    .update = digestion_update,
+    .render = digestion_render,
     .start = digestion_start,
     .input = digestion_input,
     .state = &digestion_state,
+    .state_byte_count = sizeof(digestion_state),
+    .asset_group = ASSET_GROUP_DIGESTION,
 };